@@ -1,11 +1,31 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <experimental/filesystem>
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <mutex>
 #include <string>
-#include <tuple>
+#include <thread>
 #include <vector>
 #include <map>
+#include <stdexcept>
 #include <cstdint>
+#include <cstring>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fs = std::experimental::filesystem;
 const uint8_t null = 0x00;
 
 struct bstream : public std::fstream {
@@ -34,6 +54,100 @@ struct bstream : public std::fstream {
     }
 };
 
+struct MappedFile {
+    /* Memory mapping of a whole file.
+     * An existing file is mapped copy-on-write, so the pixels can be
+     * modified in memory without touching the file on disk. A new file
+     * is created with the requested size and mapped shared, so writes
+     * to the mapping end up in the file.
+     */
+    uint8_t* data;
+    size_t size;
+
+    MappedFile(const char *filename): data(nullptr), size(0) {
+        int fd = open(filename, O_RDONLY);
+        if (fd == -1)
+            throw std::invalid_argument("Couldn't open input BitMap file");
+        struct stat st;
+        if (fstat(fd, &st) == -1 || st.st_size == 0) {
+            close(fd);
+            throw std::runtime_error("Couldn't stat input BitMap file");
+        }
+        size = st.st_size;
+        map(fd, PROT_READ|PROT_WRITE, MAP_PRIVATE);
+    }
+
+    MappedFile(const char *filename, size_t size): data(nullptr), size(size) {
+        int fd = open(filename, O_RDWR|O_CREAT|O_TRUNC, 0644);
+        if (fd == -1)
+            throw std::invalid_argument("Couldn't open output BitMap file");
+        if (ftruncate(fd, size) == -1) {                                // Pre-size the output file
+            close(fd);
+            throw std::runtime_error("Couldn't resize output BitMap file");
+        }
+        map(fd, PROT_READ|PROT_WRITE, MAP_SHARED);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        munmap(data, size);
+    }
+
+private:
+    void map(int fd, int prot, int flags) {
+        void* addr = mmap(nullptr, size, prot, flags, fd, 0);
+        close(fd);                                                      // The mapping outlives the descriptor
+        if (addr == MAP_FAILED)
+            throw std::runtime_error("Couldn't map BitMap file");
+        data = static_cast<uint8_t*>(addr);
+    }
+};
+
+template<typename T> struct PixelArray {
+    /* Strided view over a BMP pixel array.
+     * The bytes are kept in file layout: scanlines are stored bottom-up
+     * and each one is padded to a multiple of 4 bytes. Row 0 of the view
+     * is the top of the image, found by starting at the last scanline
+     * and walking backwards with a negative stride, so no copy is needed
+     * to flip the rows. The buffer is either owned by the array or is a
+     * region of a mapped file kept alive through the shared pointer.
+     * Arrays are move-only, so pixels are never duplicated implicitly.
+     */
+    typedef size_t size_type;
+
+    std::shared_ptr<uint8_t> buffer;
+    uint8_t* origin;                                                    // First byte of the top row
+    ptrdiff_t stride;
+    uint32_t width;
+    uint32_t height;
+
+    PixelArray(): origin(nullptr), stride(0), width(0), height(0) {}
+    PixelArray(const PixelArray&) = delete;
+    PixelArray& operator=(const PixelArray&) = delete;
+    PixelArray(PixelArray&&) = default;
+    PixelArray& operator=(PixelArray&&) = default;
+
+    PixelArray(uint32_t width, uint32_t height, uint32_t rowSize)
+    : PixelArray(std::shared_ptr<uint8_t>(new uint8_t[static_cast<size_t>(rowSize) * height](),
+                                          std::default_delete<uint8_t[]>()),
+                 width, height, rowSize) {}
+
+    PixelArray(std::shared_ptr<uint8_t> buffer, uint32_t width, uint32_t height, uint32_t rowSize)
+    : buffer(buffer),
+      origin(buffer.get() + static_cast<ptrdiff_t>(rowSize) * (static_cast<ptrdiff_t>(height) - 1)),
+      stride(-static_cast<ptrdiff_t>(rowSize)), width(width), height(height) {}
+
+    T* operator[](size_type i) const {
+        return reinterpret_cast<T*>(origin + static_cast<ptrdiff_t>(i) * stride);
+    }
+
+    /* Raw bytes in file order, starting with the bottom scanline. */
+    uint8_t* data() const { return buffer.get(); }
+    size_t size() const { return -stride * static_cast<size_t>(height); }
+};
+
 struct BitMapFile
 {
 public:
@@ -51,14 +165,14 @@ public:
      *   - DIB HEADER SIZE (4 byte integer) at 0x0e
      *   - BitMap width (4 byte integer) at 0x12
      *   - BitMap height (4 byte integer) at 0x16
-     *   - PLANES (2 byte integer) at 0x
-     *   - DEPTH (2 byte integer) at 0x
-     *   - COMPRESSION METHOD (4 byte integer) at 0x
-     *   - IMAGE SIZE (4 byte integer) at 0x
-     *   - HORIZONTAL RESOLUTION (4 byte integer) at 0x
-     *   - VERTICAL RESOLUTION (4 byte integer) at 0x
-     *   - NUMBER OF COLORS IN PALETTE (4 byte integer) at 0x
-     *   - NUMBER OF IMPORTANT COLORS (4 byte integer) at 0x
+     *   - PLANES (2 byte integer) at 0x1a
+     *   - DEPTH (2 byte integer) at 0x1c
+     *   - COMPRESSION METHOD (4 byte integer) at 0x1e
+     *   - IMAGE SIZE (4 byte integer) at 0x22
+     *   - HORIZONTAL RESOLUTION (4 byte integer) at 0x26
+     *   - VERTICAL RESOLUTION (4 byte integer) at 0x2a
+     *   - NUMBER OF COLORS IN PALETTE (4 byte integer) at 0x2e
+     *   - NUMBER OF IMPORTANT COLORS (4 byte integer) at 0x32
      */
     uint32_t DIBHeaderSize  ;
     uint32_t width          ;
@@ -72,6 +186,8 @@ public:
     uint32_t colorPalette   ;
     uint32_t importantColors;
 
+    static const uint32_t headerSize = 0x36;                            // BITMAPFILEHEADER + BitMapINFOHEADER
+
     BitMapFile(): signature("BM") {}
     BitMapFile(bstream& is): signature("BM") {
         is.seekg(0x02); is >> fileSize              ;
@@ -88,6 +204,70 @@ public:
            >> colorPalette
            >> importantColors;
     }
+    BitMapFile(const MappedFile& file): signature("BM") {
+        if (file.size < headerSize)
+            throw std::runtime_error("Truncated BitMap header");
+        const uint8_t* p = file.data;
+        std::memcpy(&fileSize,         p + 0x02, 4);
+        std::memcpy(&pixelArrayOffset, p + 0x0a, 4);
+        std::memcpy(&DIBHeaderSize,    p + 0x0e, 4);                    // Read BitMapINFOHEADER
+        std::memcpy(&width,            p + 0x12, 4);
+        std::memcpy(&height,           p + 0x16, 4);
+        std::memcpy(&planes,           p + 0x1a, 2);
+        std::memcpy(&depth,            p + 0x1c, 2);
+        std::memcpy(&compression,      p + 0x1e, 4);
+        std::memcpy(&imageSize,        p + 0x22, 4);
+        std::memcpy(&horizontalRes,    p + 0x26, 4);
+        std::memcpy(&verticalRes,      p + 0x2a, 4);
+        std::memcpy(&colorPalette,     p + 0x2e, 4);
+        std::memcpy(&importantColors,  p + 0x32, 4);
+    }
+
+    /* Size in bytes of one scanline, including the padding that
+     * rounds every row up to a multiple of 4 bytes.
+     */
+    uint32_t rowSize() const {
+        return ((depth * width + 31) / 32) * 4;
+    }
+
+    /* Read the whole pixel array in a single call, starting from
+     * the offset given in the file header.
+     */
+    template<typename T> PixelArray<T> readPixelArray(bstream& is) const {
+        PixelArray<T> pixelArray(width, height, rowSize());
+        is.seekg(pixelArrayOffset);
+        is.read(reinterpret_cast<char*>(pixelArray.data()), pixelArray.size());
+        if (!is)
+            throw std::runtime_error("Truncated BitMap pixel array");
+        return pixelArray;
+    }
+
+    /* View the pixel array in place inside a mapped file. */
+    template<typename T> PixelArray<T> mapPixelArray(const std::shared_ptr<MappedFile>& file) const {
+        if (pixelArrayOffset + static_cast<size_t>(rowSize()) * height > file->size)
+            throw std::runtime_error("Truncated BitMap pixel array");
+        std::shared_ptr<uint8_t> pixels(file, file->data + pixelArrayOffset);
+        return PixelArray<T>(pixels, width, height, rowSize());
+    }
+
+    /* Serialise the BITMAPFILEHEADER and BitMapINFOHEADER. */
+    void packHeader(uint8_t* p) const {
+        std::memset(p, 0, headerSize);
+        std::memcpy(p + 0x00, &signature[0],     2);
+        std::memcpy(p + 0x02, &fileSize,         4);
+        std::memcpy(p + 0x0a, &pixelArrayOffset, 4);
+        std::memcpy(p + 0x0e, &DIBHeaderSize,    4);
+        std::memcpy(p + 0x12, &width,            4);
+        std::memcpy(p + 0x16, &height,           4);
+        std::memcpy(p + 0x1a, &planes,           2);
+        std::memcpy(p + 0x1c, &depth,            2);
+        std::memcpy(p + 0x1e, &compression,      4);
+        std::memcpy(p + 0x22, &imageSize,        4);
+        std::memcpy(p + 0x26, &horizontalRes,    4);
+        std::memcpy(p + 0x2a, &verticalRes,      4);
+        std::memcpy(p + 0x2e, &colorPalette,     4);
+        std::memcpy(p + 0x32, &importantColors,  4);
+    }
 
     void printHeader() {
         std::cout << " ------------------------ \t ------------------------\n"
@@ -118,21 +298,192 @@ public:
 };
 
 struct ColourBitMapFile : public BitMapFile {
-    typedef std::tuple<uint8_t, uint8_t, uint8_t> Pixel;
-    typedef std::vector<std::vector<Pixel>> BitMap;
+    struct Pixel {                                                      // Channels in the order they are stored
+        uint8_t blue, green, red;
+    };
+    static_assert(sizeof(Pixel) == 3, "Pixel must match the packed 24-bit layout");
+    typedef PixelArray<Pixel> BitMap;
     typedef BitMap::size_type bitmap_sz;
 
     BitMap bitmap;
 
     ColourBitMapFile(bstream& is)
-    : BitMapFile(is), bitmap(height, std::vector<Pixel>(width)) {
+    : BitMapFile(is) {
         if (depth != 24)
             throw std::domain_error("Input file is a grayscale image");
-        for (bitmap_sz i = 0; i != height; ++i) {
-            for (bitmap_sz j = 0; j != width; ++j) {
-                uint8_t blue, green, red;
-                is >> blue >> green >> red;
-                bitmap[height - 1 - i][j] = std::tie(red, green, blue);
+        bitmap = readPixelArray<Pixel>(is);
+    }
+
+    ColourBitMapFile(const std::shared_ptr<MappedFile>& file)
+    : BitMapFile(*file) {
+        if (depth != 24)
+            throw std::domain_error("Input file is a grayscale image");
+        bitmap = mapPixelArray<Pixel>(file);
+    }
+};
+
+namespace luma {
+    /* BT.709 luma of one pixel. This expression defines the output;
+     * the vector kernels below evaluate exactly the same double precision
+     * operations, in the same order, so every kernel is bit-exact with it.
+     * An integer fixed-point form cannot be: a few hundred colours land on
+     * an exact integer luma, which the double result falls just short of
+     * and truncates to one less.
+     */
+    inline uint8_t bt709(uint8_t red, uint8_t green, uint8_t blue) {
+        return (red * 0.2126 + green * 0.7152 + blue * 0.0722);
+    }
+
+    /* Convert n packed blue, green, red pixels to grayscale. */
+    typedef void (*Kernel)(const uint8_t* bgr, uint8_t* gray, size_t n);
+
+    static void convertScalar(const uint8_t* bgr, uint8_t* gray, size_t n) {
+        for (size_t j = 0; j != n; ++j, bgr += 3)
+            gray[j] = bt709(bgr[2], bgr[1], bgr[0]);
+    }
+
+#ifdef __SSE2__
+    /* 4 pixels per iteration. Each pixel's 3 bytes are moved into a
+     * 32-bit lane by shifting the loaded block, then split into channels.
+     */
+    static void convertSSE2(const uint8_t* bgr, uint8_t* gray, size_t n) {
+        const __m128i mask = _mm_set1_epi32(0xff);
+        const __m128d cr = _mm_set1_pd(0.2126), cg = _mm_set1_pd(0.7152), cb = _mm_set1_pd(0.0722);
+        size_t j = 0;
+        for (; j + 6 <= n; j += 4, bgr += 12) {                         // 16 byte load must stay inside the row
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bgr));
+            __m128i p01 = _mm_unpacklo_epi32(v, _mm_srli_si128(v, 3));
+            __m128i p23 = _mm_unpacklo_epi32(_mm_srli_si128(v, 6), _mm_srli_si128(v, 9));
+            __m128i p = _mm_unpacklo_epi64(p01, p23);
+            __m128i b = _mm_and_si128(p, mask);
+            __m128i g = _mm_and_si128(_mm_srli_epi32(p, 8), mask);
+            __m128i r = _mm_and_si128(_mm_srli_epi32(p, 16), mask);
+            __m128i y[2];
+            for (int h = 0; h != 2; ++h) {
+                __m128d yd = _mm_add_pd(_mm_mul_pd(_mm_cvtepi32_pd(r), cr), _mm_mul_pd(_mm_cvtepi32_pd(g), cg));
+                yd = _mm_add_pd(yd, _mm_mul_pd(_mm_cvtepi32_pd(b), cb));
+                y[h] = _mm_cvttpd_epi32(yd);
+                r = _mm_srli_si128(r, 8); g = _mm_srli_si128(g, 8); b = _mm_srli_si128(b, 8);
+            }
+            __m128i y16 = _mm_packs_epi32(_mm_unpacklo_epi64(y[0], y[1]), _mm_setzero_si128());
+            int32_t y8 = _mm_cvtsi128_si32(_mm_packus_epi16(y16, y16));
+            std::memcpy(gray + j, &y8, 4);
+        }
+        convertScalar(bgr, gray + j, n - j);
+    }
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LUMA_HAVE_AVX2
+    /* 8 pixels per iteration. The two halves of a 24 byte block are moved
+     * into separate 128-bit lanes, and a byte shuffle per channel spreads
+     * the pixels into 32-bit lanes.
+     */
+    __attribute__((target("avx2")))
+    static void convertAVX2(const uint8_t* bgr, uint8_t* gray, size_t n) {
+        const __m256i split = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6);
+        const __m256i blue  = _mm256_setr_epi8(0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1,  9, -1, -1, -1,
+                                               0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1,  9, -1, -1, -1);
+        const __m256i green = _mm256_setr_epi8(1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1,
+                                               1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1);
+        const __m256i red   = _mm256_setr_epi8(2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1,
+                                               2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1);
+        const __m256d cr = _mm256_set1_pd(0.2126), cg = _mm256_set1_pd(0.7152), cb = _mm256_set1_pd(0.0722);
+        size_t j = 0;
+        for (; j + 11 <= n; j += 8, bgr += 24) {                        // 32 byte load must stay inside the row
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bgr));
+            v = _mm256_permutevar8x32_epi32(v, split);
+            __m256i b = _mm256_shuffle_epi8(v, blue);
+            __m256i g = _mm256_shuffle_epi8(v, green);
+            __m256i r = _mm256_shuffle_epi8(v, red);
+            __m128i y[2];
+            for (int h = 0; h != 2; ++h) {
+                __m128i rh = h ? _mm256_extracti128_si256(r, 1) : _mm256_castsi256_si128(r);
+                __m128i gh = h ? _mm256_extracti128_si256(g, 1) : _mm256_castsi256_si128(g);
+                __m128i bh = h ? _mm256_extracti128_si256(b, 1) : _mm256_castsi256_si128(b);
+                __m256d yd = _mm256_add_pd(_mm256_mul_pd(_mm256_cvtepi32_pd(rh), cr),
+                                           _mm256_mul_pd(_mm256_cvtepi32_pd(gh), cg));
+                yd = _mm256_add_pd(yd, _mm256_mul_pd(_mm256_cvtepi32_pd(bh), cb));
+                y[h] = _mm256_cvttpd_epi32(yd);
+            }
+            __m128i y16 = _mm_packs_epi32(y[0], y[1]);
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(gray + j), _mm_packus_epi16(y16, y16));
+        }
+        convertScalar(bgr, gray + j, n - j);
+    }
+#endif
+
+    static Kernel select() {
+#ifdef LUMA_HAVE_AVX2
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return convertAVX2;
+#endif
+#ifdef __SSE2__
+        return convertSSE2;
+#else
+        return convertScalar;
+#endif
+    }
+
+    inline void convert(const uint8_t* bgr, uint8_t* gray, size_t n) {
+        static const Kernel kernel = select();                         // Dispatch once on the running CPU
+        kernel(bgr, gray, n);
+    }
+};
+
+namespace tile {
+    /* Out-of-place transpose of 8-bit images of any shape.
+     * The image is walked in square tiles small enough that the source
+     * and destination rows of a tile stay in L1, and each tile is split
+     * into 8x8 blocks that are transposed in registers.
+     */
+    const size_t size = 64;
+
+    static void transpose8x8(const uint8_t* src, ptrdiff_t srcStride, uint8_t* dst, ptrdiff_t dstStride) {
+#ifdef __SSE2__
+        __m128i r[8];
+        for (int k = 0; k != 8; ++k)
+            r[k] = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + k * srcStride));
+        __m128i a0 = _mm_unpacklo_epi8(r[0], r[1]), a1 = _mm_unpacklo_epi8(r[2], r[3]);   // Interleave row pairs
+        __m128i a2 = _mm_unpacklo_epi8(r[4], r[5]), a3 = _mm_unpacklo_epi8(r[6], r[7]);
+        __m128i b0 = _mm_unpacklo_epi16(a0, a1), b1 = _mm_unpackhi_epi16(a0, a1);         // Columns of rows 0-3
+        __m128i b2 = _mm_unpacklo_epi16(a2, a3), b3 = _mm_unpackhi_epi16(a2, a3);         // Columns of rows 4-7
+        __m128i c[4] = {
+            _mm_unpacklo_epi32(b0, b2), _mm_unpackhi_epi32(b0, b2),                        // Two output rows each
+            _mm_unpacklo_epi32(b1, b3), _mm_unpackhi_epi32(b1, b3),
+        };
+        for (int k = 0; k != 4; ++k) {
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + 2*k * dstStride), c[k]);
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + (2*k + 1) * dstStride), _mm_unpackhi_epi64(c[k], c[k]));
+        }
+#else
+        for (int k = 0; k != 8; ++k)
+            for (int l = 0; l != 8; ++l)
+                dst[l * dstStride + k] = src[k * srcStride + l];
+#endif
+    }
+
+    /* dst[j][i] = src[i][j] for a rows x cols source. Strides are in
+     * bytes and may be negative, as for a bottom-up PixelArray.
+     */
+    static void transpose(const uint8_t* src, ptrdiff_t srcStride, uint8_t* dst, ptrdiff_t dstStride,
+                          size_t rows, size_t cols) {
+        for (size_t ti = 0; ti < rows; ti += size) {
+            for (size_t tj = 0; tj < cols; tj += size) {
+                size_t iEnd = std::min(ti + size, rows), jEnd = std::min(tj + size, cols);
+                size_t i = ti;
+                for (; i + 8 <= iEnd; i += 8) {
+                    size_t j = tj;
+                    for (; j + 8 <= jEnd; j += 8)
+                        transpose8x8(src + ptrdiff_t(i) * srcStride + j, srcStride, dst + ptrdiff_t(j) * dstStride + i, dstStride);
+                    for (; j != jEnd; ++j)                              // Right edge of the tile
+                        for (size_t k = i; k != i + 8; ++k)
+                            dst[ptrdiff_t(j) * dstStride + ptrdiff_t(k)] = src[ptrdiff_t(k) * srcStride + ptrdiff_t(j)];
+                }
+                for (; i != iEnd; ++i)                                  // Bottom edge of the tile
+                    for (size_t j = tj; j != jEnd; ++j)
+                        dst[ptrdiff_t(j) * dstStride + ptrdiff_t(i)] = src[ptrdiff_t(i) * srcStride + ptrdiff_t(j)];
             }
         }
     }
@@ -140,109 +491,549 @@ struct ColourBitMapFile : public BitMapFile {
 
 struct GrayScaleBitMapFile : public BitMapFile {
     typedef uint8_t Pixel;
-    typedef std::vector<std::vector<Pixel>> BitMap;
+    typedef PixelArray<Pixel> BitMap;
     typedef BitMap::size_type bitmap_sz;
 
+    static const uint32_t paletteSize = 4 * 256;                        // 256 colours * 4 channel
+
     BitMap bitmap;
 
     GrayScaleBitMapFile(bstream& is)
-    : BitMapFile(is), bitmap(height, std::vector<Pixel>(width)) {
-        for (bitmap_sz i = 0; i != height; ++i)
-            for (bitmap_sz j = 0; j != width; ++j)
-                is >> bitmap[height - 1 - i][j];
+    : BitMapFile(is) {
+        bitmap = readPixelArray<Pixel>(is);
     }
 
-    GrayScaleBitMapFile(ColourBitMapFile bmp)
-    : BitMapFile(), bitmap(bmp.height, std::vector<Pixel>(bmp.width)) {
-        uint16_t paletteSize = 4 * 256;                                 // 256 colours * 4 channel
-        fileSize        = (bmp.fileSize - bmp.imageSize) + bmp.imageSize/3 + paletteSize;
-        pixelArrayOffset= bmp.pixelArrayOffset + paletteSize;
-
-        DIBHeaderSize   = bmp.DIBHeaderSize;
-        width           = bmp.width;
-        height          = bmp.height;
+    /* Header of the grayscale version of a 24-bit image, without pixels. */
+    GrayScaleBitMapFile(const BitMapFile& bmp, bool transposed)
+    : BitMapFile() {
+        DIBHeaderSize   = 40;                                           // Always written as a BitMapINFOHEADER
+        width           = transposed ? bmp.height : bmp.width;
+        height          = transposed ? bmp.width : bmp.height;
         planes          = bmp.planes;
         depth           = bmp.depth/3;
         compression     = bmp.compression;
-        imageSize       = bmp.imageSize/3;
-        horizontalRes   = bmp.horizontalRes;
-        verticalRes     = bmp.verticalRes;
+        imageSize       = rowSize() * height;
+        horizontalRes   = transposed ? bmp.verticalRes : bmp.horizontalRes;
+        verticalRes     = transposed ? bmp.horizontalRes : bmp.verticalRes;
         colorPalette    = bmp.colorPalette;
         importantColors = bmp.importantColors;
+        pixelArrayOffset= headerSize + paletteSize;
+        fileSize        = pixelArrayOffset + imageSize;
+    }
 
-        for (bitmap_sz i = 0; i != height; ++i){                                    // Convert 24-bit image to grayscale
-            for (bitmap_sz j = 0; j != width; ++j){
-                GrayScaleBitMapFile::Pixel red, green, blue;
-                std::tie(red, green, blue) = bmp.bitmap[i][j];
-                bitmap[i][j] = (red * 0.2126 + green * 0.7152 + blue * 0.0722);     // BT.709 specification
-            }
+    /* Convert a 24-bit image to grayscale, optionally transposing it
+     * on the way. The transposed conversion goes through a small strip of
+     * grayscale rows, so in both cases the pixels are allocated only once.
+     */
+    GrayScaleBitMapFile(const ColourBitMapFile& bmp, bool transposed = false)
+    : GrayScaleBitMapFile(static_cast<const BitMapFile&>(bmp), transposed) {
+        bitmap = BitMap(width, height, rowSize());
+        if (!transposed) {
+            for (bitmap_sz i = 0; i != height; ++i)                                 // Convert 24-bit image to grayscale
+                luma::convert(reinterpret_cast<const uint8_t*>(bmp.bitmap[i]), bitmap[i], width);   // BT.709 specification
+            return;
+        }
+        const size_t strip = 16;
+        std::vector<Pixel> rows(strip * bmp.width);
+        for (bitmap_sz i = 0; i < bmp.height; i += strip) {
+            size_t n = std::min<size_t>(strip, bmp.height - i);
+            for (size_t k = 0; k != n; ++k)
+                luma::convert(reinterpret_cast<const uint8_t*>(bmp.bitmap[i + k]), &rows[k * bmp.width], bmp.width);
+            tile::transpose(rows.data(), bmp.width, bitmap[0] + i, bitmap.stride, n, bmp.width);
         }
     }
 
     void transpose() {
-        for (bitmap_sz i = 0; i != height; ++i)
-            for (bitmap_sz j = 0; j != i; ++j)
-                std::swap(bitmap[i][j], bitmap[j][i]);
         std::swap(height, width);
         std::swap(horizontalRes, verticalRes);
+        imageSize = rowSize() * height;                                 // Row padding depends on the new width
+        fileSize  = pixelArrayOffset + imageSize;
+
+        BitMap transposed(width, height, rowSize());
+        tile::transpose(bitmap[0], bitmap.stride, transposed[0], transposed.stride, width, height);
+        bitmap = std::move(transposed);
+    }
+
+    /* Serialise both headers followed by the grayscale colour palette. */
+    void packHeader(uint8_t* p) const {
+        BitMapFile::packHeader(p);
+        uint8_t* palette = p + headerSize;
+        for (uint32_t i = 0; i != 256; ++i, palette += 4) {
+            palette[0] = palette[1] = palette[2] = static_cast<uint8_t>(i);
+            palette[3] = null;
+        }
     }
 
-    bstream& save(bstream& os) {
-        os.seekp(0x00); os.write(&signature[0], 2);                                 // Write the BITMAPFILEHEADER
-        os.seekp(0x02); os << fileSize           ;
-        os.seekp(0x0a); os << pixelArrayOffset   ;
-        os << DIBHeaderSize << width << height << planes << depth << compression    // Write the BitMapINFOHEADER
-           << imageSize << horizontalRes << verticalRes << colorPalette << importantColors;
-        os << null << null << null << null;                                         // Write the grayscale colour palette
-        for(uint8_t i = 1; i != 0; ++i)
-            os << i << i << i << null;
-        for (bitmap_sz i = 0; i != height; ++i)
-            for (bitmap_sz j = 0; j != width; ++j)
-                os << bitmap[height - 1 - i][j];
+    bstream& save(bstream& os) const {
+        std::vector<uint8_t> header(pixelArrayOffset, null);
+        packHeader(header.data());
+        os.write(reinterpret_cast<const char*>(header.data()), header.size());
+        std::vector<char> padding(rowSize() - width, null);
+        for (bitmap_sz i = height; i-- != 0; ) {                                    // Scanlines are stored bottom-up
+            os.write(reinterpret_cast<const char*>(bitmap[i]), width);
+            os.write(padding.data(), padding.size());
+        }
         return os;
     }
+
+    /* Write the file through a mapping of the pre-sized output file,
+     * copying each scanline straight from the pixel array.
+     */
+    void save(const char *filename) const {
+        MappedFile file(filename, fileSize);
+        packHeader(file.data);
+        uint8_t* out = file.data + pixelArrayOffset;
+        const uint32_t stride = rowSize();
+        for (bitmap_sz i = height; i-- != 0; out += stride)
+            std::memcpy(out, bitmap[i], width);                         // Padding is already zero-filled
+    }
 };
 
-ColourBitMapFile& readBMP(char* input)
+ColourBitMapFile readBMP(const char* input)
 {
     bstream is(input, std::ios::in|std::ios::binary);                         // Open the input BMP file stream
     if (!is.is_open())                                                        // Check if file can be opened
         throw std::invalid_argument("Couldn't open input BitMap file");
-    ColourBitMapFile* colourBMP = new ColourBitMapFile(is);
-    colourBMP->printHeader();
+    ColourBitMapFile colourBMP(is);
     is.close();
-    return *colourBMP;
+    return colourBMP;
 }
 
-GrayScaleBitMapFile& convertFlipGrayScale(ColourBitMapFile& colourBMP)
+ColourBitMapFile readMappedBMP(const char* input)
 {
-    GrayScaleBitMapFile* grayscaleBMP = new GrayScaleBitMapFile(colourBMP);
-    grayscaleBMP->printHeader();
-    grayscaleBMP->transpose();
-    return *grayscaleBMP;
+    return ColourBitMapFile(std::make_shared<MappedFile>(input));             // Map the input BMP file
 }
 
-void writeBMP(char* output, GrayScaleBitMapFile& grayscaleBMP)
+GrayScaleBitMapFile convertFlipGrayScale(const ColourBitMapFile& colourBMP)
+{
+    return GrayScaleBitMapFile(colourBMP, true);
+}
+
+void writeBMP(const char* output, const GrayScaleBitMapFile& grayscaleBMP)
 {
     bstream os(output, std::ios::out|std::ios::binary);                        // Open the output BMP file stream
+    if (!os.is_open())
+        throw std::invalid_argument("Couldn't open output BitMap file");
     grayscaleBMP.save(os);
     os.close();
 }
 
+void writeMappedBMP(const char* output, const GrayScaleBitMapFile& grayscaleBMP)
+{
+    grayscaleBMP.save(output);
+}
+
+class BandReader {
+    /* Reads the scanlines of a BMP top to bottom in bands of a fixed
+     * number of rows, so that only one band is ever held in memory.
+     * Each band is a single contiguous read, since the rows of a band
+     * are adjacent in the bottom-up file layout. The band buffer is
+     * reused, so a band is only valid until the next call to read().
+     */
+public:
+    BandReader(const char* filename, uint32_t bandHeight)
+    : is(filename, std::ios::in|std::ios::binary), header(opened(is)),
+      bandHeight(std::max(1u, bandHeight)), row(0) {}
+
+    const BitMapFile& bitmapHeader() const { return header; }
+
+    template<typename T> bool read(PixelArray<T>& band) {
+        if (row == header.height)
+            return false;
+        const uint32_t n = std::min(bandHeight, header.height - row);
+        const size_t stride = header.rowSize();
+        if (!buffer)
+            buffer.reset(new uint8_t[stride * bandHeight], std::default_delete<uint8_t[]>());
+        is.seekg(header.pixelArrayOffset + stride * (header.height - row - n));
+        is.read(reinterpret_cast<char*>(buffer.get()), stride * n);
+        if (!is)
+            throw std::runtime_error("Truncated BitMap pixel array");
+        band = PixelArray<T>(buffer, header.width, n, stride);
+        row += n;
+        return true;
+    }
+
+private:
+    static bstream& opened(bstream& is) {
+        if (!is.is_open())
+            throw std::invalid_argument("Couldn't open input BitMap file");
+        return is;
+    }
+
+    bstream is;
+    BitMapFile header;
+    uint32_t bandHeight, row;
+    std::shared_ptr<uint8_t> buffer;
+};
+
+class BandWriter {
+    /* Writes a grayscale BMP top to bottom one band of rows at a time.
+     * The header is written and the file pre-sized up front, and each
+     * band is then written at its final position.
+     */
+public:
+    BandWriter(const char* filename, const GrayScaleBitMapFile& header)
+    : os(filename, std::ios::out|std::ios::binary|std::ios::trunc), header(header), row(0) {
+        if (!os.is_open())
+            throw std::invalid_argument("Couldn't open output BitMap file");
+        std::vector<uint8_t> bytes(header.pixelArrayOffset, null);
+        header.packHeader(bytes.data());
+        os.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+        os.seekp(header.fileSize - 1); os << null;
+    }
+
+    void write(const PixelArray<uint8_t>& band) {
+        const size_t stride = header.rowSize();
+        std::vector<char> padding(stride - header.width, null);
+        os.seekp(header.pixelArrayOffset + stride * (header.height - row - band.height));
+        for (uint32_t k = band.height; k-- != 0; ) {                              // Scanlines are stored bottom-up
+            os.write(reinterpret_cast<const char*>(band[k]), header.width);
+            os.write(padding.data(), padding.size());
+        }
+        if (!os)
+            throw std::runtime_error("Couldn't write output BitMap file");
+        row += band.height;
+    }
+
+private:
+    bstream os;
+    const GrayScaleBitMapFile& header;
+    uint32_t row;
+};
+
+/* Convert a 24-bit BMP of any size to grayscale while holding only a
+ * band of rows in memory. The transposed output needs every input row
+ * for each output row, so it goes through an on-disk scratch file in
+ * two passes: each input band is converted, transposed in memory and
+ * appended to the scratch file as a tile of width x band bytes; then
+ * every output band is assembled from one contiguous slice of each tile.
+ */
+void streamGrayScale(const char* input, const char* output, uint32_t bandHeight, bool transposed)
+{
+    BandReader reader(input, bandHeight);
+    const BitMapFile& colour = reader.bitmapHeader();
+    if (colour.depth != 24)
+        throw std::domain_error("Input file is a grayscale image");
+    GrayScaleBitMapFile grayscaleBMP(colour, transposed);
+    BandWriter writer(output, grayscaleBMP);
+    bandHeight = std::max(1u, bandHeight);
+
+    PixelArray<ColourBitMapFile::Pixel> band;
+    if (!transposed) {
+        PixelArray<uint8_t> gray(grayscaleBMP.width, bandHeight, grayscaleBMP.rowSize());
+        while (reader.read(band)) {
+            PixelArray<uint8_t> view(gray.buffer, band.width, band.height, grayscaleBMP.rowSize());
+            for (uint32_t k = 0; k != band.height; ++k)
+                luma::convert(reinterpret_cast<const uint8_t*>(band[k]), view[k], band.width);
+            writer.write(view);
+        }
+        return;
+    }
+
+    struct Scratch {                                                    // Removed however we leave
+        std::string path;
+        ~Scratch() { std::remove(path.c_str()); }
+    } scratch = { std::string(output) + ".scratch" };
+    bstream tiles(scratch.path.c_str(), std::ios::in|std::ios::out|std::ios::binary|std::ios::trunc);
+    if (!tiles.is_open())
+        throw std::runtime_error("Couldn't open scratch file");
+
+    const size_t width = colour.width, height = colour.height;
+    std::vector<uint8_t> rows(bandHeight * width), tile(bandHeight * width);
+    while (reader.read(band)) {                                         // Pass 1: bands to transposed tiles
+        for (uint32_t k = 0; k != band.height; ++k)
+            luma::convert(reinterpret_cast<const uint8_t*>(band[k]), &rows[k * width], width);
+        tile::transpose(rows.data(), width, tile.data(), band.height, band.height, width);
+        tiles.write(reinterpret_cast<const char*>(tile.data()), width * band.height);
+    }
+
+    PixelArray<uint8_t> out(height, bandHeight, grayscaleBMP.rowSize());
+    for (size_t j = 0; j < width; j += bandHeight) {                    // Pass 2: tiles to output bands
+        const uint32_t m = std::min<size_t>(bandHeight, width - j);
+        PixelArray<uint8_t> view(out.buffer, height, m, grayscaleBMP.rowSize());
+        for (size_t t = 0; t < height; t += bandHeight) {
+            const size_t n = std::min<size_t>(bandHeight, height - t);
+            tiles.seekg(t * width + j * n);                             // Tile rows j..j+m are contiguous
+            tiles.read(reinterpret_cast<char*>(tile.data()), m * n);
+            if (!tiles)
+                throw std::runtime_error("Couldn't read scratch file");
+            for (uint32_t k = 0; k != m; ++k)
+                std::copy(&tile[k * n], &tile[k * n] + n, view[k] + t);
+        }
+        writer.write(view);
+    }
+}
+
+template<typename T> class BoundedQueue {
+    /* Blocking FIFO joining two stages of the batch pipeline.
+     * push() waits while the queue is full, so a fast stage cannot run
+     * ahead of a slow one and hold more than `capacity` images in memory.
+     * pop() returns false once the queue is closed and drained.
+     */
+public:
+    BoundedQueue(size_t capacity): capacity(capacity), closed(false) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this] { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+    }
+
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this] { return !items.empty() || closed; });
+        if (items.empty())
+            return false;
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable notFull, notEmpty;
+    std::deque<T> items;
+    size_t capacity;
+    bool closed;
+};
+
+struct StageCounter {
+    /* Throughput of one pipeline stage, shared by all of its threads.
+     * Busy time is summed over threads, so busy/wall time is the average
+     * number of threads the stage kept occupied.
+     */
+    std::string name;
+    std::atomic<uint64_t> files, bytes, busyMicros;
+
+    StageCounter(const std::string& name): name(name), files(0), bytes(0), busyMicros(0) {}
+
+    void add(uint64_t nbytes, std::chrono::steady_clock::time_point start) {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        files += 1;
+        bytes += nbytes;
+        busyMicros += std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    }
+
+    void print(double wallSeconds) const {
+        std::cout << " " << name << "\t| " << files << " files\t| "
+                  << bytes / 1e6 / wallSeconds << " MB/s\t| "
+                  << files / wallSeconds << " files/s\t| "
+                  << busyMicros / 1e6 / wallSeconds << " threads busy\n";
+    }
+};
+
+struct BatchJob {
+    std::string input, output;
+    std::unique_ptr<ColourBitMapFile> colourBMP;                       // Only one of the two is held at a time
+    std::unique_ptr<GrayScaleBitMapFile> grayscaleBMP;
+};
+
+/* Convert many images with the read, grayscale + transpose and write
+ * stages running concurrently. Each stage has its own threads and hands
+ * images to the next one through a BoundedQueue.
+ */
+int batchMain(int argc, char* argv[])
+{
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t ioThreads = 2, queueSize = 0;
+    bool mapped = false;
+    std::vector<std::string> paths;
+    auto usage = [] {
+        std::cout << "Incorrect arguments\n"
+                     "Usage: ./a.out --batch [--threads N] [--io-threads N] [--queue N] [--mmap]\n"
+                     "                       <output directory> <input directory or image paths>...\n"
+                     "For eg: ./a.out --batch --threads 8 out/ scans/" << std::endl;
+        return -1;
+    };
+    try {
+        for (int i = 2; i < argc; ++i) {
+            std::string arg(argv[i]);
+            if (arg == "--mmap")
+                mapped = true;
+            else if (arg == "--threads" && i + 1 < argc)
+                threads = std::max(1, std::stoi(argv[++i]));
+            else if (arg == "--io-threads" && i + 1 < argc)
+                ioThreads = std::max(1, std::stoi(argv[++i]));
+            else if (arg == "--queue" && i + 1 < argc)
+                queueSize = std::max(1, std::stoi(argv[++i]));
+            else
+                paths.push_back(arg);
+        }
+    }
+    catch (const std::logic_error&) {                                  // Not a number, or out of range
+        return usage();
+    }
+    if (paths.size() < 2)
+        return usage();
+    if (queueSize == 0)
+        queueSize = 2 * threads;
+
+    fs::path outputDir(paths[0]);
+    std::vector<BatchJob> jobs;
+    auto addJob = [&](const fs::path& input) {
+        BatchJob job;
+        job.input  = input.string();
+        job.output = (outputDir / input.filename()).string();
+        jobs.push_back(std::move(job));
+    };
+    try {
+        fs::create_directories(outputDir);
+        for (auto it = paths.begin() + 1; it != paths.end(); ++it) {
+            if (fs::is_directory(*it)) {
+                for (auto& file: fs::directory_iterator(*it)) {
+                    std::string ext = file.path().extension().string();
+                    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+                    if (ext == ".bmp" && fs::is_regular_file(file.path()))
+                        addJob(file.path());
+                }
+            }
+            else {
+                addJob(*it);
+            }
+        }
+    }
+    catch (const fs::filesystem_error& e) {
+        std::cerr << e.what() << std::endl;
+        return -1;
+    }
+
+    std::mutex logMutex;
+    std::atomic<size_t> next(0), failed(0);
+    auto fail = [&](const BatchJob& job, const std::exception& e) {
+        std::lock_guard<std::mutex> lock(logMutex);
+        std::cerr << job.input << ": " << e.what() << std::endl;
+        ++failed;
+    };
+
+    BoundedQueue<BatchJob> readQueue(queueSize), writeQueue(queueSize);
+    StageCounter readStage("read"), convertStage("convert"), writeStage("write");
+
+    auto reader = [&] {
+        for (size_t i; (i = next++) < jobs.size(); ) {
+            BatchJob job = std::move(jobs[i]);
+            auto start = std::chrono::steady_clock::now();
+            try {
+                job.colourBMP.reset(new ColourBitMapFile(
+                    mapped ? readMappedBMP(job.input.c_str()) : readBMP(job.input.c_str())));
+            }
+            catch (const std::exception& e) {
+                fail(job, e);
+                continue;
+            }
+            readStage.add(job.colourBMP->fileSize, start);
+            readQueue.push(std::move(job));
+        }
+    };
+    auto converter = [&] {
+        for (BatchJob job; readQueue.pop(job); ) {
+            auto start = std::chrono::steady_clock::now();
+            try {
+                job.grayscaleBMP.reset(new GrayScaleBitMapFile(convertFlipGrayScale(*job.colourBMP)));
+            }
+            catch (const std::exception& e) {
+                fail(job, e);
+                continue;
+            }
+            convertStage.add(job.colourBMP->imageSize, start);
+            job.colourBMP.reset();                                      // Release the colour pixels early
+            writeQueue.push(std::move(job));
+        }
+    };
+    auto writer = [&] {
+        for (BatchJob job; writeQueue.pop(job); ) {
+            auto start = std::chrono::steady_clock::now();
+            try {
+                if (mapped)
+                    writeMappedBMP(job.output.c_str(), *job.grayscaleBMP);
+                else
+                    writeBMP(job.output.c_str(), *job.grayscaleBMP);
+            }
+            catch (const std::exception& e) {
+                fail(job, e);
+                continue;
+            }
+            writeStage.add(job.grayscaleBMP->fileSize, start);
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> readers, converters, writers;
+    for (size_t i = 0; i != ioThreads; ++i) readers.emplace_back(reader);
+    for (size_t i = 0; i != threads; ++i)   converters.emplace_back(converter);
+    for (size_t i = 0; i != ioThreads; ++i) writers.emplace_back(writer);
+    for (auto& t: readers) t.join();                                    // Shut the pipeline down stage by stage
+    readQueue.close();
+    for (auto& t: converters) t.join();
+    writeQueue.close();
+    for (auto& t: writers) t.join();
+    double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "Converted " << writeStage.files << " of " << jobs.size() << " files in "
+              << wallSeconds << " s with " << threads << " worker threads\n";
+    readStage.print(wallSeconds);
+    convertStage.print(wallSeconds);
+    writeStage.print(wallSeconds);
+    return failed ? -1 : 0;
+}
+
 
 int main(int argc, char* argv[])
 {
-    if (argc != 3) {                                                            // Check for commandline arguments
+    if (argc > 1 && std::string(argv[1]) == "--batch")                         // Batch mode never waits for input
+        return batchMain(argc, argv);
+
+    bool mapped = false, streamed = false;
+    uint32_t bandHeight = 256;
+    int arg = 1;
+    for (; arg < argc - 2; ++arg) {                                             // Options precede the paths
+        std::string option(argv[arg]);
+        if (option == "--mmap")
+            mapped = true;
+        else if (option == "--stream")
+            streamed = true;
+        else if (option == "--band" && arg + 1 < argc - 2) {
+            try {
+                bandHeight = std::max(1, std::stoi(argv[++arg]));
+            }
+            catch (const std::logic_error&) {                           // Not a number: report the usage
+                arg = 0;
+                break;
+            }
+        }
+        else
+            break;
+    }
+    if (argc - arg != 2) {                                                      // Check for commandline arguments
         std::cout << "Incorrect arguments\n"
-                     "Usage: ./a.out <input image path> <output image path>\n"
+                     "Usage: ./a.out [--mmap | --stream [--band N]] <input image path> <output image path>\n"
+                     "       ./a.out --batch [options] <output directory> <input paths>...\n"
                      "For eg: ./a.out lena.bmp out.bmp";
         return -1;
     }
+    char* input  = argv[argc - 2];
+    char* output = argv[argc - 1];
 
     try {
-        ColourBitMapFile colourBMP = readBMP(argv[1]);
+        if (streamed) {
+            streamGrayScale(input, output, bandHeight, true);
+            return 0;
+        }
+        ColourBitMapFile colourBMP = mapped ? readMappedBMP(input) : readBMP(input);
+        colourBMP.printHeader();
         GrayScaleBitMapFile grayscaleBMP = convertFlipGrayScale(colourBMP);
-        writeBMP(argv[2], grayscaleBMP);
+        grayscaleBMP.printHeader();
+        if (mapped)
+            writeMappedBMP(output, grayscaleBMP);
+        else
+            writeBMP(output, grayscaleBMP);
     }
     catch(...) {
         std::cout << "Error reading BMP file" <<std::endl;
@@ -252,4 +1043,4 @@ int main(int argc, char* argv[])
     std::string temp;
     std::cin >> temp;
     return 0;
-}
\ No newline at end of file
+}
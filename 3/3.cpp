@@ -2,13 +2,402 @@
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
 #include <experimental/filesystem>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <numeric>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+#include <utility>
 #include <vector>
 
+#include "../4/fft.hpp"
+
 namespace fs = std::experimental::filesystem;
-typedef const std::vector<std::vector<int>> Kernel;
+
+struct FilterKernel {
+    /* Square convolution kernel, analysed once when it is built:
+     *   - den is the normalisation constant, the sum of the positive taps
+     *   - box is set when all taps are equal, so a running sum suffices
+     *   - separable is set when a rank-1 decomposition h = column * row
+     *     into integer vectors exists, so two 1D passes suffice
+     *   - nonZero lists the taps the vector engine has to visit, and
+     *     positive/negative bound the partial sums it may see
+     */
+    typedef void (*RowKernel)(const uint8_t* const* window, uint8_t* out, int begin, int end);
+    struct Tap {
+        int k, l, value;
+    };
+
+    std::vector<std::vector<int>> h;
+    std::vector<int> column, row;
+    std::vector<Tap> nonZero;
+    int den, positive, negative;
+    bool box, separable;
+    RowKernel fixedRow;                                                             // Specialised interior loop, if any
+
+    FilterKernel(std::initializer_list<std::initializer_list<int>> taps)
+    : h(taps.begin(), taps.end()), fixedRow(nullptr) {
+        analyse();
+    }
+
+    explicit FilterKernel(std::vector<std::vector<int>> taps)                      // Any odd square size, e.g. read at run time
+    : h(std::move(taps)), fixedRow(nullptr) {
+        analyse();
+    }
+
+    template<size_t N>
+    FilterKernel(const int (&taps)[N][N], RowKernel fixedRow)
+    : h(N), fixedRow(fixedRow) {
+        for (size_t k = 0; k != N; ++k)
+            h[k].assign(taps[k], taps[k] + N);
+        analyse();
+    }
+
+    size_t size() const { return h.size(); }
+    const std::vector<int>& operator[](size_t k) const { return h[k]; }
+
+private:
+    void analyse() {
+        if (h.size() % 2 == 0 || std::any_of(h.begin(), h.end(), [&](const std::vector<int> &r) { return r.size() != h.size(); }))
+            throw std::invalid_argument("Kernels must be square with an odd number of rows");
+        positive = negative = 0;
+        box = true;
+        separable = false;
+        for (size_t k = 0; k != h.size(); ++k) {
+            for (size_t l = 0; l != h[k].size(); ++l) {
+                auto tap = h[k][l];
+                if (tap >= 0)                                                       // Normalize the filter output
+                    positive += tap;                                                // using positive sum of the kernel
+                else
+                    negative -= tap;
+                if (tap != 0)
+                    nonZero.push_back({ int(k), int(l), tap });
+                box = box && tap == h[0][0];
+            }
+        }
+        den = positive ? positive : 1;                                              // No positive taps: leave the sum unscaled
+        decompose();
+    }
+
+    /* Every non-zero row must be an integer multiple of the first non-zero
+     * row reduced by its gcd; the multiples then form the column vector.
+     */
+    void decompose() {
+        auto first = std::find_if(h.begin(), h.end(), [](const std::vector<int> &r) {
+            return std::any_of(r.begin(), r.end(), [](int tap) { return tap != 0; });
+        });
+        if (first == h.end())
+            return;
+        auto divisor = 0;
+        for (auto tap: *first)
+            divisor = gcd(divisor, std::abs(tap));
+        for (auto tap: *first)
+            row.push_back(tap / divisor);
+        auto pivot = std::find_if(row.begin(), row.end(), [](int tap) { return tap != 0; }) - row.begin();
+        for (auto &r: h) {
+            if (r[pivot] % row[pivot] != 0)
+                return;
+            auto multiple = r[pivot] / row[pivot];
+            for (size_t l = 0; l != r.size(); ++l)
+                if (r[l] != multiple * row[l])
+                    return;
+            column.push_back(multiple);
+        }
+        separable = true;
+    }
+
+    static int gcd(int a, int b) {
+        while (b != 0)
+            std::swap(a %= b, b);
+        return a;
+    }
+};
+typedef const FilterKernel Kernel;
+
+namespace simd {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CONVOLUTE_HAVE_AVX2
+    /* |sum|/den for 8 lanes. The quotient comes from a precomputed float
+     * reciprocal and is then corrected by at most one using the exact
+     * integer remainder.
+     */
+    __attribute__((target("avx2")))
+    static inline __m256i quotient(__m256i sum, __m256 reciprocal, __m256i den)
+    {
+        auto a = _mm256_abs_epi32(sum);
+        auto q = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(a), reciprocal));
+        auto remainder = _mm256_sub_epi32(a, _mm256_mullo_epi32(q, den));
+        q = _mm256_add_epi32(q, _mm256_srai_epi32(remainder, 31));                   // Quotient one too large
+        return _mm256_sub_epi32(q, _mm256_cmpgt_epi32(remainder, _mm256_sub_epi32(den, _mm256_set1_epi32(1))));
+    }
+
+    /* |sum|/den modulo 256, as the scalar path stores it. */
+    __attribute__((target("avx2")))
+    static inline __m256i normalise(__m256i sum, __m256 reciprocal, __m256i den)
+    {
+        return _mm256_and_si256(quotient(sum, reciprocal, den), _mm256_set1_epi32(0xff));
+    }
+
+    /* 16 pixels widened to 16 bits. */
+    __attribute__((target("avx2")))
+    static inline __m256i widen(const uint8_t* p)
+    {
+        return _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+    }
+
+    /* Interior of one output row, 16 pixels per iteration. Each tap loads
+     * 16 pixels and widens them to 16 bits. When the kernel cannot
+     * overflow 16 bits the products are accumulated there directly;
+     * otherwise taps are paired and multiply-added into 32-bit sums.
+     * Both produce sums for pixels [0-3, 8-11] and [4-7, 12-15], the lane
+     * order in which the packs below restore the row.
+     * Returns the first column left for the scalar loop.
+     */
+    __attribute__((target("avx2")))
+    static int convoluteRowAVX2(const uint8_t* const* window, uint8_t* out, int begin, int end, const FilterKernel &h)
+    {
+        const int r = h.size()/2;
+        const auto reciprocal = _mm256_set1_ps(1.0f / h.den);
+        const auto den = _mm256_set1_epi32(h.den);
+        const bool narrow = std::max(h.positive, h.negative) * 255 <= INT16_MAX;
+        auto j = begin;
+        for (; j + 16 <= end; j += 16) {
+            __m256i lo, hi;
+            if (narrow) {
+                auto acc = _mm256_setzero_si256();
+                for (auto &t: h.nonZero)
+                    acc = _mm256_add_epi16(acc, _mm256_mullo_epi16(widen(window[t.k] + j + t.l - r), _mm256_set1_epi16(t.value)));
+                lo = _mm256_srai_epi32(_mm256_unpacklo_epi16(acc, acc), 16);         // Sign extend to 32 bits
+                hi = _mm256_srai_epi32(_mm256_unpackhi_epi16(acc, acc), 16);
+            }
+            else {
+                lo = hi = _mm256_setzero_si256();
+                for (size_t t = 0; t < h.nonZero.size(); t += 2) {
+                    auto &a = h.nonZero[t];
+                    auto &b = t + 1 < h.nonZero.size() ? h.nonZero[t + 1] : a;
+                    auto bValue = t + 1 < h.nonZero.size() ? b.value : 0;
+                    auto pa = widen(window[a.k] + j + a.l - r), pb = widen(window[b.k] + j + b.l - r);
+                    auto taps = _mm256_set1_epi32(int(unsigned(bValue) << 16) | (a.value & 0xffff));
+                    lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(pa, pb), taps));
+                    hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(pa, pb), taps));
+                }
+            }
+            auto words = _mm256_packus_epi32(normalise(lo, reciprocal, den), normalise(hi, reciprocal, den));
+            auto bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(words, words), 0x08);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + j), _mm256_castsi256_si128(bytes));
+        }
+        return j;
+    }
+
+    /* compass() for 16 pixels, from the sums of the four directions in
+     * the lane order convoluteRowAVX2() produces them. The packs saturate
+     * the magnitude to 8 bits.
+     */
+    __attribute__((target("avx2")))
+    static inline void compass(const __m256i (&lo)[4], const __m256i (&hi)[4], const int (&den)[4],
+                               uint8_t* magnitude, uint8_t* orientation)
+    {
+        __m256i best[2], index[2];
+        for (auto half = 0; half != 2; ++half) {
+            const auto &sum = half ? hi : lo;
+            best[half] = quotient(sum[0], _mm256_set1_ps(1.0f / den[0]), _mm256_set1_epi32(den[0]));
+            index[half] = _mm256_setzero_si256();
+            for (auto k = 1; k != 4; ++k) {
+                auto q = quotient(sum[k], _mm256_set1_ps(1.0f / den[k]), _mm256_set1_epi32(den[k]));
+                auto stronger = _mm256_cmpgt_epi32(q, best[half]);                 // Ties keep the lower index
+                best[half] = _mm256_max_epi32(best[half], q);
+                index[half] = _mm256_blendv_epi8(index[half], _mm256_set1_epi32(k), stronger);
+            }
+        }
+        auto words = _mm256_packus_epi32(best[0], best[1]);
+        auto bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(words, words), 0x08);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(magnitude), _mm256_castsi256_si128(bytes));
+        if (orientation) {
+            words = _mm256_packus_epi32(index[0], index[1]);
+            bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(words, words), 0x08);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(orientation), _mm256_castsi256_si128(bytes));
+        }
+    }
+
+    static bool haveAVX2()
+    {
+        static const bool supported = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+        return supported;
+    }
+#else
+    static bool haveAVX2() { return false; }
+#endif
+
+    /* Taps must fit the 16-bit multiplies, and sums must stay below 2^21
+     * for the float reciprocal to be within one of the quotient.
+     */
+    static bool usable(const FilterKernel &h)
+    {
+        return haveAVX2() && !h.nonZero.empty()
+            && std::all_of(h.nonZero.begin(), h.nonZero.end(), [](const FilterKernel::Tap &t) { return std::abs(t.value) <= INT16_MAX; })
+            && static_cast<long>(h.positive + h.negative) * 255 < (1 << 21);
+    }
+};
+
+template<int N, const int (&H)[N][N]>
+struct FixedKernel {
+    /* Interior loop generated for one kernel known at compile time. The
+     * taps are expanded into straight-line code with the coefficients as
+     * constants, so zero taps vanish, the division by den becomes a
+     * multiply, and the loop over the row can be vectorised.
+     */
+    static constexpr int positiveSum(int k = 0, int l = 0) {
+        return k == N ? 0 : (H[k][l] > 0 ? H[k][l] : 0) + positiveSum(l + 1 == N ? k + 1 : k, (l + 1) % N);
+    }
+    static constexpr int den = positiveSum() ? positiveSum() : 1;
+
+    template<size_t... I>
+    static inline int dot(const uint8_t* const* window, int j, std::index_sequence<I...>) {
+        auto sum = 0;
+        int unused[] = { (sum += H[I / N][I % N] * window[I / N][j + int(I % N) - N/2], 0)... };
+        (void)unused;
+        return sum;
+    }
+
+    static void row(const uint8_t* const* window, uint8_t* out, int begin, int end) {
+        for (auto j = begin; j != end; ++j)
+            out[j] = abs(dot(window, j, std::make_index_sequence<N*N>()) / den);
+    }
+};
+
+template<int N, const int (&H)[N][N]>
+static FilterKernel fixed()
+{
+    return FilterKernel(H, FixedKernel<N, H>::row);
+}
+
+/* Compass edge response from the four directional responses, each
+ * already normalised as convolute() would: the magnitude is the
+ * strongest of them saturated to 8 bits, the orientation the index of
+ * the gradient axis it came from, 0, 1, 2, 3 for 0, 45, 90, 135 degrees.
+ */
+static inline void compass(const int (&response)[4], uint8_t &magnitude, uint8_t &orientation)
+{
+    auto best = 0;
+    for (auto d = 1; d != 4; ++d)
+        if (response[d] > response[best])
+            best = d;
+    magnitude = std::min(response[best], 255);
+    orientation = best;
+}
+
+template<int N, const int (&H)[N][N], const int (&V)[N][N], const int (&D)[N][N]>
+struct FixedEdges {
+    /* Interior loops of the fused edge operator: the vertical, diagonal
+     * and horizontal Sobel kernels plus the diagonal mirrored left to
+     * right, expanded over one read of each neighbourhood. In the vector
+     * loop zero taps vanish and the load of each window position is
+     * shared by all four directions.
+     */
+    static constexpr int tap(const int (&K)[N][N], bool mirror, int p) {
+        return p >= N*N ? 0 : K[p / N][mirror ? N-1 - p % N : p % N];
+    }
+    static constexpr int sum(const int (&K)[N][N], int sign, int p = 0) {
+        return p == N*N ? 0 : (sign * tap(K, false, p) > 0 ? sign * tap(K, false, p) : 0) + sum(K, sign, p + 1);
+    }
+    static constexpr bool narrow(const int (&K)[N][N]) {
+        return (sum(K, 1) > sum(K, -1) ? sum(K, 1) : sum(K, -1)) * 255 <= INT16_MAX;
+    }
+
+    template<size_t... I>
+    static inline int mirrored(const uint8_t* const* window, int j, std::index_sequence<I...>) {
+        auto sum = 0;
+        int unused[] = { (sum += tap(D, true, I) * window[I / N][j + int(I % N) - N/2], 0)... };
+        (void)unused;
+        return sum;
+    }
+
+    static void row(const uint8_t* const* window, uint8_t* magnitude, uint8_t* orientation, int begin, int end) {
+        const auto taps = std::make_index_sequence<N*N>();
+        for (auto j = begin; j != end; ++j) {
+            const int response[4] = {
+                abs(FixedKernel<N, V>::dot(window, j, taps) / FixedKernel<N, V>::den),
+                abs(FixedKernel<N, D>::dot(window, j, taps) / FixedKernel<N, D>::den),
+                abs(FixedKernel<N, H>::dot(window, j, taps) / FixedKernel<N, H>::den),
+                abs(mirrored(window, j, taps) / FixedKernel<N, D>::den),
+            };
+            uint8_t unused;
+            compass(response, magnitude[j], orientation ? orientation[j] : unused);
+        }
+    }
+
+#ifdef CONVOLUTE_HAVE_AVX2
+    template<int T>
+    __attribute__((target("avx2")))
+    static inline __m256i multiply(__m256i acc, const uint8_t* p) {
+        return T ? _mm256_add_epi16(acc, _mm256_mullo_epi16(simd::widen(p), _mm256_set1_epi16(T))) : acc;
+    }
+
+    template<int A, int B>
+    __attribute__((target("avx2")))
+    static inline void multiplyAdd(__m256i &lo, __m256i &hi, const uint8_t* a, const uint8_t* b) {
+        if (A == 0 && B == 0)
+            return;
+        auto pa = simd::widen(a), pb = simd::widen(b);
+        auto taps = _mm256_set1_epi32(int(unsigned(B) << 16) | (A & 0xffff));
+        lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(pa, pb), taps));
+        hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(pa, pb), taps));
+    }
+
+    /* Sums of kernel K for 16 pixels: in 16 bits when they cannot
+     * overflow, otherwise multiply-added in pairs of positions.
+     */
+    template<const int (&K)[N][N], bool Mirror, size_t... I>
+    __attribute__((target("avx2")))
+    static inline void sums(const uint8_t* const* window, int j, __m256i &lo, __m256i &hi, std::index_sequence<I...>) {
+        if (narrow(K)) {
+            auto acc = _mm256_setzero_si256();
+            int unused[] = { (acc = multiply<tap(K, Mirror, I)>(acc, window[I / N] + j + int(I % N) - N/2), 0)... };
+            (void)unused;
+            lo = _mm256_srai_epi32(_mm256_unpacklo_epi16(acc, acc), 16);
+            hi = _mm256_srai_epi32(_mm256_unpackhi_epi16(acc, acc), 16);
+            return;
+        }
+        lo = hi = _mm256_setzero_si256();
+        int unused[] = { (I % 2 ? 0 : (multiplyAdd<tap(K, Mirror, I), tap(K, Mirror, I + 1)>(lo, hi,
+                              window[I / N] + j + int(I % N) - N/2,
+                              window[(I + 1) % (N*N) / N] + j + int((I + 1) % (N*N) % N) - N/2), 0))... };
+        (void)unused;
+    }
+
+    __attribute__((target("avx2")))
+    static int rowAVX2(const uint8_t* const* window, uint8_t* magnitude, uint8_t* orientation, int begin, int end) {
+        const auto taps = std::make_index_sequence<N*N>();
+        const int den[4] = { FixedKernel<N, V>::den, FixedKernel<N, D>::den, FixedKernel<N, H>::den, FixedKernel<N, D>::den };
+        auto j = begin;
+        for (; j + 16 <= end; j += 16) {
+            __m256i lo[4], hi[4];
+            sums<V, false>(window, j, lo[0], hi[0], taps);
+            sums<D, false>(window, j, lo[1], hi[1], taps);
+            sums<H, false>(window, j, lo[2], hi[2], taps);
+            sums<D, true>(window, j, lo[3], hi[3], taps);
+            simd::compass(lo, hi, den, magnitude + j, orientation ? orientation + j : nullptr);
+        }
+        return j;
+    }
+#endif
+};
 
 enum FILTER {
     MEAN = 0,
@@ -19,23 +408,65 @@ enum FILTER {
     SOBEL_HORIZONTAL,
     SOBEL_VERTICAL,
     SOBEL_DIAGONAL,
+    SOBEL_MAGNITUDE,
 };
 enum KERNEL {
     THREE = 0,
     FIVE,
     SEVEN,
 };
+enum BORDER {
+    REPLICATE = 0,
+    REFLECT,
+    CONSTANT,
+};
+
+struct Border {
+    /* How taps falling outside the image are filled:
+     *   - REPLICATE  aaa|abcd|ddd
+     *   - REFLECT    cba|abcd|dcb
+     *   - CONSTANT   vvv|abcd|vvv
+     */
+    BORDER mode;
+    int value;
+
+    Border(BORDER mode = REPLICATE, int value = 0): mode(mode), value(value) {}
+
+    /* Index of the pixel supplying position x of a line of n pixels,
+     * or -1 where the constant value is used instead.
+     */
+    int map(int x, int n) const {
+        if (x >= 0 && x < n)
+            return x;
+        switch (mode) {
+        case BORDER::REPLICATE:
+            return x < 0 ? 0 : n - 1;
+        case BORDER::REFLECT:
+            while (x < 0 || x >= n)                                                 // Kernels may be wider than the image
+                x = x < 0 ? -x - 1 : 2*n - x - 1;
+            return x;
+        default:
+            return -1;
+        }
+    }
+
+    int pixel(const cv::Mat &input, int i, int j) const {
+        auto row = map(i, input.rows), col = map(j, input.cols);
+        return (row < 0 || col < 0) ? value : input.ptr<uint8_t>(row)[col];
+    }
+};
 
-std::vector<cv::Mat> unfiltered;
-int imagePos = 0, filterPos = 0, kernelPos = 0;
+int imagePos = 0, filterPos = 0, kernelPos = 0, borderPos = 0;
+unsigned threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+int tileRows = 0;                                                                   // 0 gives every thread a few bands
 
-Kernel MEAN_3 = {
+constexpr int MEAN_3_TAPS[3][3] = {
     { 1,  1,  1 },
     { 1,  1,  1 },
     { 1,  1,  1 },
 };
 
-Kernel MEAN_5 = {
+constexpr int MEAN_5_TAPS[5][5] = {
     { 1,  1,  1,  1,  1 },
     { 1,  1,  1,  1,  1 },
     { 1,  1,  1,  1,  1 },
@@ -43,7 +474,7 @@ Kernel MEAN_5 = {
     { 1,  1,  1,  1,  1 },
 };
 
-Kernel MEAN_7 = {
+constexpr int MEAN_7_TAPS[7][7] = {
     { 1,  1,  1,  1,  1,  1,  1 },
     { 1,  1,  1,  1,  1,  1,  1 },
     { 1,  1,  1,  1,  1,  1,  1 },
@@ -53,13 +484,13 @@ Kernel MEAN_7 = {
     { 1,  1,  1,  1,  1,  1,  1 },
 };
 
-Kernel GRADIENT_H_3 =   {
+constexpr int GRADIENT_H_3_TAPS[3][3] = {
     {-1, -1, -1 },
     { 0,  0,  0 },
     { 1,  1,  1 },
 };
 
-Kernel GRADIENT_H_5 = {
+constexpr int GRADIENT_H_5_TAPS[5][5] = {
     { -1, -1, -1, -1, -1 },
     { -2, -2, -2, -2, -2 },
     {  0,  0,  0,  0,  0 },
@@ -67,7 +498,7 @@ Kernel GRADIENT_H_5 = {
     {  1,  1,  1,  1,  1 },
 };
 
-Kernel GRADIENT_H_7 =  {
+constexpr int GRADIENT_H_7_TAPS[7][7] = {
     { -1, -1, -1, -1, -1, -1, -1 },
     { -2, -2, -2, -2, -2, -2, -2 },
     { -3, -3, -3, -3, -3, -3, -3 },
@@ -77,13 +508,13 @@ Kernel GRADIENT_H_7 =  {
     {  1,  1,  1,  1,  1,  1,  1 },
 };
 
-Kernel GRADIENT_V_3 = {
+constexpr int GRADIENT_V_3_TAPS[3][3] = {
     { 1, 0, -1 },
     { 1, 0, -1 },
     { 1, 0, -1 },
 };
 
-Kernel GRADIENT_V_5 ={
+constexpr int GRADIENT_V_5_TAPS[5][5] = {
     { -1, -2,  0,  2,  1},
     { -1, -2,  0,  2,  1},
     { -1, -2,  0,  2,  1},
@@ -91,7 +522,7 @@ Kernel GRADIENT_V_5 ={
     { -1, -2,  0,  2,  1}
 };
 
-Kernel GRADIENT_V_7 = {
+constexpr int GRADIENT_V_7_TAPS[7][7] = {
     { -1, -2, -3,  0,  3,  2,  1},
     { -1, -2, -3,  0,  3,  2,  1},
     { -1, -2, -3,  0,  3,  2,  1},
@@ -101,13 +532,13 @@ Kernel GRADIENT_V_7 = {
     { -1, -2, -3,  0,  3,  2,  1},
 };
 
-Kernel LAPLACIAN_3 = {
+constexpr int LAPLACIAN_3_TAPS[3][3] = {
     { -1, -1, -1},
     { -1,  8, -1},
     { -1, -1, -1},
 };
 
-Kernel LAPLACIAN_5 = {
+constexpr int LAPLACIAN_5_TAPS[5][5] = {
     { -1,  3, -4, -3, -1},
     { -3,  0,  6,  0, -3},
     { -4,  6, 20,  6, -4},
@@ -115,7 +546,7 @@ Kernel LAPLACIAN_5 = {
     { -1, -3, -4, -3, -1},
 };
 
-Kernel LAPLACIAN_7 = {
+constexpr int LAPLACIAN_7_TAPS[7][7] = {
     { -2, -3, -4, -6, -4, -3, -2},
     { -3, -5, -4, -3, -4, -5, -3},
     { -4, -4,  9, 20,  9, -4, -4},
@@ -125,13 +556,13 @@ Kernel LAPLACIAN_7 = {
     { -2, -3, -4, -6, -4, -3, -2},
 };
 
-Kernel SOBEL_H_3 = {
+constexpr int SOBEL_H_3_TAPS[3][3] = {
     {  1,  2,  1},
     {  0,  0,  0},
     { -1, -2, -1},
 };
 
-Kernel SOBEL_H_5 = {
+constexpr int SOBEL_H_5_TAPS[5][5] = {
     {  1,   4,   7,   4,  1},
     {  2,  10,  17,  10,  2},
     {  0,   0,   0,   0,  0},
@@ -139,7 +570,7 @@ Kernel SOBEL_H_5 = {
     { -1,  -4,  -7,  -4, -1},
 };
 
-Kernel SOBEL_H_7 = {
+constexpr int SOBEL_H_7_TAPS[7][7] = {
     {  1,   4,   9,  13,   9,   4,  1},
     {  3,  11,  26,  34,  26,  11,  3},
     {  3,  13,  30,  40,  30,  13,  3},
@@ -149,13 +580,13 @@ Kernel SOBEL_H_7 = {
     { -1,  -4,  -9, -13,  -9,  -4, -1},
 };
 
-Kernel SOBEL_V_3 = {
+constexpr int SOBEL_V_3_TAPS[3][3] = {
     { -1,  0,  1 },
     { -2,  0,  2 },
     { -1,  0,  1 },
 };
 
-Kernel SOBEL_V_5 = {
+constexpr int SOBEL_V_5_TAPS[5][5] = {
     { -1,  -2, 0,  2, 1},
     { -4, -10, 0, 10, 4},
     { -7, -17, 0, 17, 7},
@@ -163,7 +594,7 @@ Kernel SOBEL_V_5 = {
     { -1,  -2, 0, -2, 1},
 };
 
-Kernel SOBEL_V_7 = {
+constexpr int SOBEL_V_7_TAPS[7][7] = {
     {  -1,  -3,  -3, 0, 3,  3,   1},
     {  -4, -11, -13, 0, 13, 11,  4},
     {  -9, -26, -30, 0, 30, 26,  9},
@@ -173,13 +604,13 @@ Kernel SOBEL_V_7 = {
     {   1,  -3,  -3, 0,  3,  3,  1},
 };
 
-Kernel SOBEL_D_3 = {
+constexpr int SOBEL_D_3_TAPS[3][3] = {
     {  0,  1,  2},
     { -1,  0,  1},
     { -2, -1,  0},
 };
 
-Kernel SOBEL_D_5 = {
+constexpr int SOBEL_D_5_TAPS[5][5] = {
     {  0,  1,  2,  3,  4},
     { -1,  0,  1,  2,  3},
     { -2, -1,  0,  1,  2},
@@ -187,7 +618,7 @@ Kernel SOBEL_D_5 = {
     { -4, -3, -2, -1,  0},
 };
 
-Kernel SOBEL_D_7 = {
+constexpr int SOBEL_D_7_TAPS[7][7] = {
     {  0,  1,  2,  3,  4,  5,  6},
     { -1,  0,  1,  2,  3,  4,  5},
     { -2, -1,  0,  1,  2,  3,  4},
@@ -198,147 +629,1140 @@ Kernel SOBEL_D_7 = {
 };
 
 
-static void convolute(const cv::Mat &input, cv::Mat &output, Kernel h)
+Kernel MEAN_3       = fixed<3, MEAN_3_TAPS>();
+Kernel MEAN_5       = fixed<5, MEAN_5_TAPS>();
+Kernel MEAN_7       = fixed<7, MEAN_7_TAPS>();
+Kernel GRADIENT_H_3 = fixed<3, GRADIENT_H_3_TAPS>();
+Kernel GRADIENT_H_5 = fixed<5, GRADIENT_H_5_TAPS>();
+Kernel GRADIENT_H_7 = fixed<7, GRADIENT_H_7_TAPS>();
+Kernel GRADIENT_V_3 = fixed<3, GRADIENT_V_3_TAPS>();
+Kernel GRADIENT_V_5 = fixed<5, GRADIENT_V_5_TAPS>();
+Kernel GRADIENT_V_7 = fixed<7, GRADIENT_V_7_TAPS>();
+Kernel LAPLACIAN_3  = fixed<3, LAPLACIAN_3_TAPS>();
+Kernel LAPLACIAN_5  = fixed<5, LAPLACIAN_5_TAPS>();
+Kernel LAPLACIAN_7  = fixed<7, LAPLACIAN_7_TAPS>();
+Kernel SOBEL_H_3    = fixed<3, SOBEL_H_3_TAPS>();
+Kernel SOBEL_H_5    = fixed<5, SOBEL_H_5_TAPS>();
+Kernel SOBEL_H_7    = fixed<7, SOBEL_H_7_TAPS>();
+Kernel SOBEL_V_3    = fixed<3, SOBEL_V_3_TAPS>();
+Kernel SOBEL_V_5    = fixed<5, SOBEL_V_5_TAPS>();
+Kernel SOBEL_V_7    = fixed<7, SOBEL_V_7_TAPS>();
+Kernel SOBEL_D_3    = fixed<3, SOBEL_D_3_TAPS>();
+Kernel SOBEL_D_5    = fixed<5, SOBEL_D_5_TAPS>();
+Kernel SOBEL_D_7    = fixed<7, SOBEL_D_7_TAPS>();
+
+/* Thread pool running the row bands of one filter at a time. Bands are
+ * dealt round robin to per-thread queues; a thread whose queue runs dry
+ * steals from the back of another's, so slow bands (edges, other load)
+ * do not leave cores idle. The calling thread works the first queue.
+ * Each band reads whatever halo rows it needs but writes only its own
+ * output rows, so the result is the same for any thread count or tiling.
+ */
+class TilePool {
+public:
+    typedef std::function<void(int first, int last)> Band;
+
+    explicit TilePool(unsigned threads)
+    {
+        for (auto t = 0u; t != std::max(threads, 1u); ++t)
+            queues.emplace_back(new Queue());
+        for (auto t = 1u; t < queues.size(); ++t)
+            workers.emplace_back(&TilePool::loop, this, t);
+    }
+
+    ~TilePool()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stop = true;
+        }
+        wake.notify_all();
+        for (auto &worker: workers)
+            worker.join();
+    }
+
+    unsigned size() const { return queues.size(); }
+
+    /* Run band(first, last) over [0, rows) in bands of tile rows and
+     * return once all of them are done.
+     */
+    void run(int rows, int tile, const Band &band)
+    {
+        if (tile <= 0)
+            tile = std::max(16, (rows + 4*int(size()) - 1) / (4*int(size())));
+        if (rows <= 0)
+            return;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            /* Set before any band is queued: a thread still leaving the
+             * last run may take one at once and count it off.
+             */
+            job = &band;
+            remaining = (rows + tile - 1) / tile;
+            auto count = 0;
+            for (auto first = 0; first < rows; first += tile, ++count) {
+                auto &queue = *queues[count % queues.size()];
+                std::lock_guard<std::mutex> hold(queue.lock);
+                queue.bands.emplace_back(first, std::min(first + tile, rows));
+            }
+            ++generation;
+        }
+        wake.notify_all();
+        work(0);
+        std::unique_lock<std::mutex> guard(lock);
+        finished.wait(guard, [&] { return remaining == 0; });
+    }
+
+private:
+    struct Queue {
+        std::mutex lock;
+        std::deque<std::pair<int, int>> bands;
+    };
+
+    bool take(unsigned self, std::pair<int, int> &band)
+    {
+        for (auto k = 0u; k != queues.size(); ++k) {
+            auto &queue = *queues[(self + k) % queues.size()];
+            std::lock_guard<std::mutex> guard(queue.lock);
+            if (queue.bands.empty())
+                continue;
+            if (k == 0) {                                                           // Own queue from the front
+                band = queue.bands.front();
+                queue.bands.pop_front();
+            }
+            else {                                                                  // Steal from the back
+                band = queue.bands.back();
+                queue.bands.pop_back();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void work(unsigned self)
+    {
+        std::pair<int, int> band;
+        while (take(self, band)) {
+            (*job)(band.first, band.second);
+            if (--remaining == 0) {
+                std::lock_guard<std::mutex> guard(lock);
+                finished.notify_all();
+            }
+        }
+    }
+
+    void loop(unsigned self)
+    {
+        auto seen = 0u;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wake.wait(guard, [&] { return stop || generation != seen; });
+                if (stop)
+                    return;
+                seen = generation;
+            }
+            work(self);
+        }
+    }
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable wake, finished;
+    const Band *job = nullptr;
+    std::atomic<int> remaining{0};
+    unsigned generation = 0;
+    bool stop = false;
+};
+
+static TilePool &tiles()
+{
+    static TilePool pool(threadCount);
+    return pool;
+}
+
+/* Every .jpg below root, in path order. */
+static std::vector<std::string> findImages(const std::string &root)
 {
-    for (auto i = 0; i != output.rows; ++i) {
-        for (auto j = 0; j != output.cols; ++j) {
-            auto sum = 0, den=0;
-            for(auto k = 0; k != h.size(); ++k) {
-                for(auto l = 0; l != h.size(); ++l) {
-                    sum += input.at<uint8_t>(i+k - h.size()/2, j+l - h.size()/2) * h[k][l];
-                    if (h[k][l] >= 0)                                               // Normalize the filter output
-                        den += h[k][l];                                             // using positive sum of the kernel
+    std::vector<std::string> paths;
+    for (auto& file: fs::recursive_directory_iterator(root)) {
+        std::string imagePath(static_cast<std::string>(file.path()));
+        if (imagePath.find(".jpg") != std::string::npos) {
+            paths.push_back(imagePath);
+        }
+    }
+    std::sort(paths.begin(), paths.end());
+    return paths;
+}
+
+/* Images below a directory, decoded on first use: opening it only
+ * lists the paths. Each access queues the neighbouring images for a
+ * background thread to decode ahead, and once the decoded images exceed
+ * the memory budget the least recently used are dropped, to be decoded
+ * again if they are needed later. Prefetched images count as the least
+ * recent until they are used, and are not decoded while the last image
+ * decoded would not fit the budget.
+ */
+class ImageCatalogue {
+public:
+    ImageCatalogue(size_t budget, int radius): budget(budget), radius(radius)
+    {
+        loader = std::thread(&ImageCatalogue::prefetch, this);
+    }
+
+    ~ImageCatalogue()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stop = true;
+        }
+        wake.notify_all();
+        loader.join();
+    }
+
+    /* Before the first access only. */
+    void open(const std::string &root)
+    {
+        for (auto &path: findImages(root))
+            entries.push_back(Entry{ path, cv::Mat(), false, recent.end() });
+    }
+
+    void resize(size_t bytes)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        budget = bytes;
+        evict(entries.size());
+    }
+
+    size_t size() const { return entries.size(); }
+    const std::string& path(size_t i) const { return entries.at(i).path; }
+
+    cv::Mat at(size_t i)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        auto &entry = entries.at(i);
+        loaded.wait(guard, [&] { return !entry.loading; });                         // Already being prefetched
+        if (entry.image.empty()) {
+            entry.loading = true;
+            guard.unlock();
+            auto image = cv::imread(entry.path, cv::IMREAD_GRAYSCALE);
+            guard.lock();
+            store(i, image);
+            if (image.empty())
+                throw std::runtime_error("Cannot read " + entry.path);
+        }
+        recent.splice(recent.begin(), recent, entry.use);                          // Most recently used
+        pending.clear();
+        for (auto k = 1; k <= radius; ++k) {
+            if (i + k < entries.size())
+                pending.push_back(i + k);
+            if (i >= size_t(k))
+                pending.push_back(i - k);
+        }
+        wake.notify_one();
+        return entry.image;
+    }
+
+private:
+    struct Entry {
+        std::string path;
+        cv::Mat image;
+        bool loading;
+        std::list<size_t>::iterator use;                                           // Position in recent when decoded
+    };
+
+    static size_t bytes(const cv::Mat &image) { return image.total() * image.elemSize(); }
+
+    /* Lock held. A new image goes in as the least recently used. */
+    void store(size_t i, const cv::Mat &image)
+    {
+        auto &entry = entries[i];
+        entry.loading = false;
+        if (!image.empty()) {
+            entry.image = image;
+            entry.use = recent.insert(recent.end(), i);
+            used += last = bytes(image);
+            evict(i);
+        }
+        loaded.notify_all();
+    }
+
+    /* Lock held. Drop least recently used images down to the budget,
+     * keeping the one most recently used and image keep.
+     */
+    void evict(size_t keep)
+    {
+        auto victim = recent.end();
+        while (used > budget && victim != recent.begin() && std::prev(victim) != recent.begin()) {
+            --victim;
+            if (*victim == keep)
+                continue;
+            auto &entry = entries[*victim];
+            used -= bytes(entry.image);
+            entry.image.release();
+            victim = recent.erase(victim);
+            entry.use = recent.end();
+        }
+    }
+
+    void prefetch()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        for (;;) {
+            wake.wait(guard, [&] { return stop || !pending.empty(); });
+            if (stop)
+                return;
+            auto i = pending.front();
+            pending.pop_front();
+            auto &entry = entries[i];
+            if (!entry.image.empty() || entry.loading || used + last > budget)
+                continue;
+            entry.loading = true;
+            guard.unlock();
+            auto image = cv::imread(entry.path, cv::IMREAD_GRAYSCALE);
+            guard.lock();
+            store(i, image);
+        }
+    }
+
+    std::vector<Entry> entries;
+    std::list<size_t> recent;                                                       // Decoded images, most recent first
+    std::deque<size_t> pending;
+    size_t budget, used = 0, last = 0;
+    int radius;
+    std::mutex lock;
+    std::condition_variable wake, loaded;
+    bool stop = false;
+    std::thread loader;
+};
+
+size_t memoryBudget = 512 << 20;                                                    // 512 MiB unless set
+
+/* The images of the GUI and --verify, one read ahead either side of the
+ * one shown. Made on first use, so that --batch starts no loader.
+ */
+static ImageCatalogue &unfiltered()
+{
+    static ImageCatalogue catalogue(memoryBudget, 1);
+    return catalogue;
+}
+
+/* Pixels whose window lies entirely inside the image run a tight loop
+ * over raw row pointers. Only the strips within r of an edge take the
+ * slow path, which maps every tap through the border mode.
+ */
+static void convoluteGeneric(const cv::Mat &input, cv::Mat &output, Kernel &h, const Border &border,
+                             int first, int last, bool vectorise = true)
+{
+    const int n = h.size(), r = n/2, rows = input.rows, cols = input.cols;
+    const int top = std::min(r, rows), bottom = std::max(top, rows - r);            // Interior is [top, bottom) x [left, right)
+    const int left = std::min(r, cols), right = std::max(left, cols - r);
+    auto edge = [&](int i, int j) {
+        auto sum = 0;
+        for (auto k = 0; k != n; ++k)
+            for (auto l = 0; l != n; ++l)
+                sum += border.pixel(input, i+k - r, j+l - r) * h[k][l];
+        return static_cast<uint8_t>(abs(sum/h.den));                                // Use absolute value to flip negative gradients
+    };
+    const bool avx2 = vectorise && simd::usable(h);
+
+    std::vector<const uint8_t*> window(n);
+    for (auto i = first; i != last; ++i) {
+        auto *out = output.ptr<uint8_t>(i);
+        if (i < top || i >= bottom) {
+            for (auto j = 0; j != cols; ++j)
+                out[j] = edge(i, j);
+            continue;
+        }
+        for (auto j = 0; j != left; ++j)
+            out[j] = edge(i, j);
+        for (auto j = right; j != cols; ++j)
+            out[j] = edge(i, j);
+        for (auto k = 0; k != n; ++k)
+            window[k] = input.ptr<uint8_t>(i+k - r);
+        auto begin = left;
+#ifdef CONVOLUTE_HAVE_AVX2
+        if (avx2)
+            begin = simd::convoluteRowAVX2(window.data(), out, left, right, h);
+#endif
+        if (h.fixedRow && vectorise) {
+            h.fixedRow(window.data(), out, begin, right);
+            continue;
+        }
+        for (auto j = begin; j != right; ++j) {
+            auto sum = 0;
+            for (auto k = 0; k != n; ++k) {
+                const auto *in = window[k] + j - r;
+                const auto *tap = h[k].data();
+                for (auto l = 0; l != n; ++l)
+                    sum += in[l] * tap[l];
+            }
+            out[j] = abs(sum/h.den);
+        }
+    }
+}
+
+/* Two 1D passes for a kernel h = column * row: 2k instead of k^2
+ * multiplies per pixel. The row pass keeps exact 32-bit sums; rows
+ * outside the image under a constant border sum to value * sum(row).
+ * Only the input rows the band's windows map to get a row pass.
+ */
+static void convoluteSeparable(const cv::Mat &input, cv::Mat &output, Kernel &h, const Border &border,
+                               int first, int last)
+{
+    const int n = h.size(), r = n/2, rows = input.rows, cols = input.cols;
+    const int left = std::min(r, cols), right = std::max(left, cols - r);
+    auto low = rows, high = -1;
+    for (auto i = first; i != last; ++i) {
+        for (auto k = 0; k != n; ++k) {
+            auto row = border.map(i+k - r, rows);
+            if (row >= 0) {
+                low = std::min(low, row);
+                high = std::max(high, row);
+            }
+        }
+    }
+    cv::Mat rowPass(std::max(high - low + 1, 1), cols, CV_32SC1);
+    for (auto i = low; i <= high; ++i) {
+        const auto *in = input.ptr<uint8_t>(i);
+        auto *out = rowPass.ptr<int32_t>(i - low);
+        auto edge = [&](int j) {
+            auto sum = 0;
+            for (auto l = 0; l != n; ++l)
+                sum += border.pixel(input, i, j+l - r) * h.row[l];
+            return sum;
+        };
+        for (auto j = 0; j != left; ++j)
+            out[j] = edge(j);
+        for (auto j = right; j != cols; ++j)
+            out[j] = edge(j);
+        for (auto j = left; j != right; ++j) {
+            auto sum = 0;
+            for (auto l = 0; l != n; ++l)
+                sum += in[j+l - r] * h.row[l];
+            out[j] = sum;
+        }
+    }
+
+    const std::vector<int32_t> constantRow(cols, border.value * std::accumulate(h.row.begin(), h.row.end(), 0));
+    std::vector<const int32_t*> window(n);
+    for (auto i = first; i != last; ++i) {
+        for (auto k = 0; k != n; ++k) {
+            auto row = border.map(i+k - r, rows);
+            window[k] = row < 0 ? constantRow.data() : rowPass.ptr<int32_t>(row - low);
+        }
+        auto *out = output.ptr<uint8_t>(i);
+        for (auto j = 0; j != cols; ++j) {
+            auto sum = 0;
+            for (auto k = 0; k != n; ++k)
+                sum += window[k][j] * h.column[k];
+            out[j] = abs(sum/h.den);
+        }
+    }
+}
+
+/* Kernel with all taps equal: keep a running sum of every column over
+ * the window rows, and a running sum of those along the row, so each
+ * pixel costs a constant number of additions whatever the kernel size.
+ * Column sums are kept for the r columns past each edge as well.
+ */
+static void convoluteBox(const cv::Mat &input, cv::Mat &output, Kernel &h, const Border &border,
+                         int first, int last)
+{
+    const int n = h.size(), r = n/2, cols = input.cols;
+    std::vector<int> columns(cols + 2*r, 0);
+    auto accumulate = [&](int i, int sign) {
+        auto row = border.map(i, input.rows);
+        if (row < 0) {
+            for (auto &c: columns)
+                c += sign * border.value;
+            return;
+        }
+        const auto *in = input.ptr<uint8_t>(row);
+        auto *c = columns.data() + r;
+        for (auto j = 0; j != cols; ++j)
+            c[j] += sign * in[j];
+        for (auto j = -r; j != 0; ++j)                                              // Columns past the edges
+            c[j] += sign * border.pixel(input, row, j);
+        for (auto j = cols; j != cols + r; ++j)
+            c[j] += sign * border.pixel(input, row, j);
+    };
+    for (auto i = first - r; i != first + r; ++i)                                   // Halo above the band
+        accumulate(i, 1);
+    for (auto i = first; i != last; ++i) {
+        accumulate(i + r, 1);                                                       // Window rows are now i-r..i+r
+        auto sum = std::accumulate(columns.begin(), columns.begin() + n - 1, 0);
+        auto *out = output.ptr<uint8_t>(i);
+        for (auto j = 0; j != cols; ++j) {
+            sum += columns[j + n - 1];
+            out[j] = abs(sum * h[0][0] / h.den);
+            sum -= columns[j];
+        }
+        accumulate(i - r, -1);
+    }
+}
+
+/* Kernel ready for convolution through the FFT by overlap-save: each
+ * size x size tile of input, border included, is transformed, multiplied
+ * by the conjugate spectrum of the kernel (a correlation, like the
+ * spatial engines) and transformed back. The step x step outputs whose
+ * windows lie inside the tile are kept, step = size - n + 1.
+ */
+struct FrequencyKernel {
+    int size, step;
+    FFT::Spectrum spectrum;
+
+    FrequencyKernel(Kernel &h, int size)
+    : size(size), step(size - int(h.size()) + 1) {
+        std::vector<double> padded(size_t(size) * size, 0.0);
+        for (auto &tap: h.nonZero)
+            padded[size_t(tap.k) * size + tap.l] = tap.value;
+        spectrum = FFT::transform2d(size, size, [&](int i) { return &padded[size_t(i) * size]; });
+        for (auto i = 0; i != size; ++i)
+            for (auto j = 0; j != spectrum.bins(); ++j)
+                spectrum[i][j] = std::conj(spectrum[i][j]);
+    }
+
+    /* Estimated cost per output pixel of a rows x cols image in tiles of
+     * this size, in the FFT planner's units: for every tile, including
+     * those only partly used at the edges, a forward and an inverse 2D
+     * transform, the product and the gathering of the tile.
+     */
+    static double cost(int n, int size, int rows, int cols) {
+        const auto step = size - n + 1, bins = size/2 + 1;
+        const auto tiles = double((rows + step - 1)/step) * ((cols + step - 1)/step);
+        auto row = FFT::Plan::get(size/2).cost + 6.0*size;                          // Packed real transform
+        auto column = FFT::Plan::get(size).cost;
+        return tiles * (2*(size*row + bins*column) + 6.0*size*bins + 2.0*size*size) / (double(rows) * cols);
+    }
+
+    /* Even 2/3/5-smooth tile size, from 2n up to what covers the whole
+     * image in one tile, of least cost per output pixel. Past 1024 or 16n
+     * the tiles only fall out of cache, so larger ones are not tried.
+     */
+    static int best(int n, int rows, int cols, double &perPixel) {
+        auto smooth = [](int m) {
+            for (auto p: { 2, 3, 5 })
+                while (m % p == 0)
+                    m /= p;
+            return m == 1;
+        };
+        const auto whole = std::max(rows, cols) + n - 1, largest = std::max(16*n, 1024);
+        auto best = 0;
+        perPixel = std::numeric_limits<double>::infinity();
+        for (auto size = 2*n; ; ++size) {
+            if (size % 2 != 0 || !smooth(size))
+                continue;
+            auto c = cost(n, size, rows, cols);
+            if (c < perPixel) {
+                perPixel = c;
+                best = size;
+            }
+            if (size >= whole || size >= largest)
+                break;
+        }
+        return best;
+    }
+};
+
+static void convoluteFrequency(const cv::Mat &input, cv::Mat &output, Kernel &h, const FrequencyKernel &g,
+                               const Border &border, int first, int last)
+{
+    const int r = h.size()/2, rows = input.rows, cols = input.cols, size = g.size, step = g.step;
+    std::vector<double> tile(size_t(size) * size);
+    std::vector<int> sources(size);
+    for (auto left = 0; left < cols; left += step) {
+        const auto width = std::min(step, cols - left);
+        for (auto q = 0; q != size; ++q)
+            sources[q] = border.map(left - r + q, cols);
+        for (auto top = first; top < last; top += step) {
+            const auto height = std::min(step, last - top);
+            for (auto p = 0; p != size; ++p) {
+                auto *t = &tile[size_t(p) * size];
+                auto row = border.map(top - r + p, rows);
+                if (row < 0) {
+                    std::fill(t, t + size, border.value);
+                    continue;
                 }
+                const auto *in = input.ptr<uint8_t>(row);
+                for (auto q = 0; q != size; ++q)
+                    t[q] = sources[q] < 0 ? border.value : in[sources[q]];
             }
-            output.at<uint8_t>(i, j) = abs(sum/den);                                // Use absolute value to flip negative gradients
+            auto X = FFT::transform2d(size, size, [&](int p) { return &tile[size_t(p) * size]; });
+            for (auto i = 0; i != size; ++i) {
+                auto *x = X[i];
+                const auto *y = g.spectrum[i];
+                for (auto j = 0; j != X.bins(); ++j)
+                    x[j] = FFT::multiply(x[j], y[j]);
+            }
+            FFT::inverseTransform2d(std::move(X), [&](int p, const double *sums) {
+                if (p >= height)
+                    return;
+                auto *out = output.ptr<uint8_t>(top + p) + left;
+                for (auto q = 0; q != width; ++q) {
+                    auto sum = static_cast<int>(std::lround(sums[q]));                 // The exact integer sum
+                    out[q] = abs(sum/h.den);
+                }
+            });
         }
     }
 }
 
-static void Median(const cv::Mat &input, cv::Mat &output, int kernel)
+static void convolute(const cv::Mat &input, cv::Mat &output, Kernel &h, const Border &border = Border(),
+                      int tile = tileRows)
 {
-    std::vector<uint8_t> neighbourhood;
-    for (auto i = 0; i != output.rows; ++i) {
+    const int n = h.size();
+    const bool direct = (simd::usable(h) && n <= 7) || (h.fixedRow && n <= 5);    // Direct loops beat two passes on small kernels
+    if (!h.box && !direct && !h.fixedRow) {
+        /* Cost per pixel in the FFT planner's units, about 0.3 ns each:
+         * measured per tap, the vector engine slowing as its window grows.
+         * The predefined kernels are small and unrolled, never worth it.
+         */
+        auto taps = double(h.nonZero.size()), frequencyCost = 0.0;
+        auto spatialCost = h.separable ? 4.5*n : simd::usable(h) ? (0.3 + 0.017*n) * taps : 2.0*taps;
+        auto size = FrequencyKernel::best(n, input.rows, input.cols, frequencyCost);
+        if (frequencyCost < spatialCost) {
+            const FrequencyKernel g(h, size);
+            tiles().run(input.rows, g.step, [&](int first, int last) {                 // Whole tiles per band
+                convoluteFrequency(input, output, h, g, border, first, last);
+            });
+            return;
+        }
+    }
+    decltype(&convoluteBox) engine;
+    if (h.box && n > 5)
+        engine = convoluteBox;
+    else if (direct || !(h.box || h.separable))
+        engine = [](const cv::Mat &input, cv::Mat &output, Kernel &h, const Border &border, int first, int last) {
+            convoluteGeneric(input, output, h, border, first, last);
+        };
+    else if (h.box)
+        engine = convoluteBox;
+    else
+        engine = convoluteSeparable;
+    tiles().run(input.rows, tile, [&](int first, int last) {
+        engine(input, output, h, border, first, last);
+    });
+}
+
+/* Median over the in-bounds part of the window for any element type.
+ * Near the borders the window may hold an even number of values, in
+ * which case the two middle ones are averaged.
+ */
+template<typename T>
+static void MedianSort(const cv::Mat &input, cv::Mat &output, int kernel, int first, int last)
+{
+    std::vector<T> neighbourhood;
+    for (auto i = first; i != last; ++i) {
         for (auto j = 0; j != output.cols; ++j) {
             neighbourhood.clear();
             for (auto k = -kernel/2; k <= kernel/2; ++k) {
                 for (auto l = -kernel/2; l <= kernel/2; ++l) {
                     if ((i+k >=0 && i+k < output.rows) && (j+l >=0 && j+l < output.cols)) {
-                        neighbourhood.push_back(input.at<uint8_t>(i+k, j+l));
+                        neighbourhood.push_back(input.at<T>(i+k, j+l));
                     }
                 }
             }
             auto size = neighbourhood.size();
-            std::sort(neighbourhood.begin(), neighbourhood.end());
+            auto middle = neighbourhood.begin() + size/2;
+            std::nth_element(neighbourhood.begin(), middle, neighbourhood.end());
             if (size % 2 == 0) {
-                output.at<uint8_t>(i, j) = (neighbourhood.at(size/2 - 1) + neighbourhood.at(size/2 + 1))/2;
+                auto below = *std::max_element(neighbourhood.begin(), middle);              // Largest of the lower half
+                output.at<T>(i, j) = (below + *middle)/2;
             }
             else {
-                output.at<uint8_t>(i, j) = neighbourhood.at(size/2);
+                output.at<T>(i, j) = *middle;
             }
         }
     }
 }
 
-static void callBack(int, void*)
+/* Constant time median filter for 8-bit images (Perreault & Hebert).
+ * A histogram is kept for every column over the rows of the current
+ * window. Moving one pixel to the right adds the histogram of the column
+ * entering the window and subtracts the one leaving it, and moving down
+ * a row updates each column histogram by one pixel, so the cost per pixel
+ * does not depend on the kernel size. A 16 bin coarse histogram kept
+ * alongside the 256 bin one finds the median in two short scans.
+ */
+static void MedianHistogram(const cv::Mat &input, cv::Mat &output, int kernel, int first, int last)
 {
-    std::string filterText, kernel;
-    cv::Mat display, input = unfiltered.at(imagePos), output(input.size(), input.type());
-    switch(filterPos) {
-    case FILTER::MEAN:
-        filterText = "Mean: ";
-        switch (kernelPos) {
-            case KERNEL::THREE: kernel = "3"; convolute(input, output, MEAN_3); break;
-            case KERNEL::FIVE : kernel = "5"; convolute(input, output, MEAN_5); break;
-            case KERNEL::SEVEN: kernel = "7"; convolute(input, output, MEAN_7); break;
+    struct Histogram {
+        uint16_t coarse[16];
+        uint16_t fine[256];
+
+        void insert(uint8_t v) { ++coarse[v >> 4]; ++fine[v]; }
+        void remove(uint8_t v) { --coarse[v >> 4]; --fine[v]; }
+        void add(const Histogram &h) {
+            for (auto k = 0; k != 16; ++k)  coarse[k] += h.coarse[k];
+            for (auto k = 0; k != 256; ++k) fine[k] += h.fine[k];
         }
-        break;
-    case FILTER::MEDIAN:
-        filterText = "Median: ";
-        switch (kernelPos) {
-            case KERNEL::THREE: kernel = "3"; Median(input, output, 3); break;
-            case KERNEL::FIVE : kernel = "5"; Median(input, output, 5); break;
-            case KERNEL::SEVEN: kernel = "7"; Median(input, output, 7); break;
+        void subtract(const Histogram &h) {
+            for (auto k = 0; k != 16; ++k)  coarse[k] -= h.coarse[k];
+            for (auto k = 0; k != 256; ++k) fine[k] -= h.fine[k];
         }
-        break;
-    case FILTER::GRADIENT_HORIZONTAL:
-        filterText = "Gradient Horizontal: ";
-        switch (kernelPos) {
-            case KERNEL::THREE: kernel = "3"; convolute(input, output, GRADIENT_H_3); break;
-            case KERNEL::FIVE : kernel = "5"; convolute(input, output, GRADIENT_H_5); break;
-            case KERNEL::SEVEN: kernel = "7"; convolute(input, output, GRADIENT_H_7); break;
+        int select(int rank) const {                                                // Value of the rank-th smallest element
+            auto c = 0;
+            while (rank >= coarse[c])
+                rank -= coarse[c++];
+            auto f = 16*c;
+            while (rank >= fine[f])
+                rank -= fine[f++];
+            return f;
         }
-        break;
-    case FILTER::GRADIENT_VERTICAL:
-        filterText = "Gradient Vertical: ";
-        switch (kernelPos) {
-            case KERNEL::THREE: kernel = "3"; convolute(input, output, GRADIENT_V_3); break;
-            case KERNEL::FIVE : kernel = "5"; convolute(input, output, GRADIENT_V_5); break;
-            case KERNEL::SEVEN: kernel = "7"; convolute(input, output, GRADIENT_V_7); break;
+    };
+
+    const auto r = kernel/2, rows = input.rows, cols = input.cols;
+    const auto top = std::max(first - r, 0);
+    std::vector<Histogram> columns(cols, Histogram());
+    for (auto i = top; i < std::min(first + r, rows); ++i) {                        // Rows shared with the first window
+        const auto *in = input.ptr<uint8_t>(i);
+        for (auto j = 0; j != cols; ++j)
+            columns[j].insert(in[j]);
+    }
+    for (auto i = first; i != last; ++i) {
+        if (i + r < rows) {                                                         // Slide the column histograms down
+            const auto *in = input.ptr<uint8_t>(i + r);
+            for (auto j = 0; j != cols; ++j)
+                columns[j].insert(in[j]);
         }
-        break;
-    case FILTER::LAPLACIAN:
-        filterText = "Laplacian: ";
-        switch (kernelPos) {
-            case KERNEL::THREE: kernel = "3"; convolute(input, output, LAPLACIAN_3); break;
-            case KERNEL::FIVE : kernel = "5"; convolute(input, output, LAPLACIAN_5); break;
-            case KERNEL::SEVEN: kernel = "7"; convolute(input, output, LAPLACIAN_7); break;
+        if (i - r - 1 >= top) {
+            const auto *in = input.ptr<uint8_t>(i - r - 1);
+            for (auto j = 0; j != cols; ++j)
+                columns[j].remove(in[j]);
         }
-        break;
-    case FILTER::SOBEL_HORIZONTAL:
-        filterText = "Sobel Horizontal: ";
-        switch (kernelPos) {
-            case KERNEL::THREE: kernel = "3"; convolute(input, output, SOBEL_H_3); break;
-            case KERNEL::FIVE : kernel = "5"; convolute(input, output, SOBEL_H_5); break;
-            case KERNEL::SEVEN: kernel = "7"; convolute(input, output, SOBEL_H_7); break;
+        const auto height = std::min(i + r, rows - 1) - std::max(i - r, 0) + 1;
+
+        Histogram window = Histogram();
+        for (auto j = 0; j < std::min(r, cols); ++j)
+            window.add(columns[j]);
+        auto *out = output.ptr<uint8_t>(i);
+        for (auto j = 0; j != cols; ++j) {
+            if (j + r < cols)                                                       // Slide the window right
+                window.add(columns[j + r]);
+            if (j - r - 1 >= 0)
+                window.subtract(columns[j - r - 1]);
+            const auto size = height * (std::min(j + r, cols - 1) - std::max(j - r, 0) + 1);
+            if (size % 2 == 0)
+                out[j] = (window.select(size/2 - 1) + window.select(size/2))/2;
+            else
+                out[j] = window.select(size/2);
         }
+    }
+}
+
+static void Median(const cv::Mat &input, cv::Mat &output, int kernel, int tile = tileRows)
+{
+    decltype(&MedianHistogram) engine;
+    switch (input.depth()) {
+    case CV_8U:
+        if (kernel * kernel <= UINT16_MAX)                                          // Window counts must fit the bins
+            engine = MedianHistogram;
+        else
+            engine = MedianSort<uint8_t>;
         break;
-    case FILTER::SOBEL_VERTICAL:
-        filterText = "Sobel Vertical: ";
-        switch (kernelPos) {
-            case KERNEL::THREE: kernel = "3"; convolute(input, output, SOBEL_V_3); break;
-            case KERNEL::FIVE : kernel = "5"; convolute(input, output, SOBEL_V_5); break;
-            case KERNEL::SEVEN: kernel = "7"; convolute(input, output, SOBEL_V_7); break;
+    case CV_16U: engine = MedianSort<uint16_t>; break;
+    case CV_16S: engine = MedianSort<int16_t>;  break;
+    case CV_32F: engine = MedianSort<float>;    break;
+    case CV_64F: engine = MedianSort<double>;   break;
+    default:
+        throw std::invalid_argument("Unsupported image depth for median filter");
+    }
+    tiles().run(input.rows, tile, [&](int first, int last) {
+        engine(input, output, kernel, first, last);
+    });
+}
+
+/* Compass response at one pixel with every tap mapped through the
+ * border mode; used near the edges, and as the reference for --verify.
+ */
+static void edgeAt(const cv::Mat &input, int i, int j, Kernel &h, Kernel &v, Kernel &d, const Border &border,
+                   uint8_t &magnitude, uint8_t &orientation)
+{
+    const int n = h.size(), r = n/2;
+    int sum[4] = { 0, 0, 0, 0 };
+    for (auto k = 0; k != n; ++k) {
+        for (auto l = 0; l != n; ++l) {
+            auto pixel = border.pixel(input, i+k - r, j+l - r);
+            sum[0] += pixel * v[k][l];
+            sum[1] += pixel * d[k][l];
+            sum[2] += pixel * h[k][l];
+            sum[3] += pixel * d[k][n-1 - l];
         }
+    }
+    const int response[4] = { abs(sum[0]/v.den), abs(sum[1]/d.den), abs(sum[2]/h.den), abs(sum[3]/d.den) };
+    compass(response, magnitude, orientation);
+}
+
+/* Edge magnitude, and the orientation if asked for, from the Sobel
+ * kernels of one size in a single pass over the image. Running the
+ * directional filters one after another reads the input and writes an
+ * image per direction; here each neighbourhood is read once and only
+ * the results are written. The compass operator also takes the diagonal
+ * mirrored left to right, so the orientation covers 0 to 135 degrees.
+ */
+static void Edges(const cv::Mat &input, cv::Mat &magnitude, cv::Mat *orientation, int kernel,
+                  const Border &border = Border(), int tile = tileRows)
+{
+    typedef void (*EdgeRow)(const uint8_t* const*, uint8_t*, uint8_t*, int, int);
+    typedef int (*VectorEdgeRow)(const uint8_t* const*, uint8_t*, uint8_t*, int, int);
+    Kernel *h, *v, *d;
+    EdgeRow fixedRow;
+    VectorEdgeRow vectorRow = nullptr;
+    switch (kernel) {
+    case 3:
+        h = &SOBEL_H_3; v = &SOBEL_V_3; d = &SOBEL_D_3;
+        fixedRow = FixedEdges<3, SOBEL_H_3_TAPS, SOBEL_V_3_TAPS, SOBEL_D_3_TAPS>::row;
+#ifdef CONVOLUTE_HAVE_AVX2
+        vectorRow = FixedEdges<3, SOBEL_H_3_TAPS, SOBEL_V_3_TAPS, SOBEL_D_3_TAPS>::rowAVX2;
+#endif
+        break;
+    case 5:
+        h = &SOBEL_H_5; v = &SOBEL_V_5; d = &SOBEL_D_5;
+        fixedRow = FixedEdges<5, SOBEL_H_5_TAPS, SOBEL_V_5_TAPS, SOBEL_D_5_TAPS>::row;
+#ifdef CONVOLUTE_HAVE_AVX2
+        vectorRow = FixedEdges<5, SOBEL_H_5_TAPS, SOBEL_V_5_TAPS, SOBEL_D_5_TAPS>::rowAVX2;
+#endif
         break;
-    case FILTER::SOBEL_DIAGONAL:
-        filterText = "Sobel Diagonal: ";
-        switch (kernelPos) {
-            case KERNEL::THREE: kernel = "3"; convolute(input, output, SOBEL_D_3); break;
-            case KERNEL::FIVE : kernel = "5"; convolute(input, output, SOBEL_D_5); break;
-            case KERNEL::SEVEN: kernel = "7"; convolute(input, output, SOBEL_D_7); break;
+    case 7:
+        h = &SOBEL_H_7; v = &SOBEL_V_7; d = &SOBEL_D_7;
+        fixedRow = FixedEdges<7, SOBEL_H_7_TAPS, SOBEL_V_7_TAPS, SOBEL_D_7_TAPS>::row;
+#ifdef CONVOLUTE_HAVE_AVX2
+        vectorRow = FixedEdges<7, SOBEL_H_7_TAPS, SOBEL_V_7_TAPS, SOBEL_D_7_TAPS>::rowAVX2;
+#endif
+        break;
+    default:
+        throw std::invalid_argument("Sobel kernels come in sizes 3, 5 and 7");
+    }
+    const bool avx2 = vectorRow && simd::usable(*h) && simd::usable(*v) && simd::usable(*d);
+    const int r = kernel/2, rows = input.rows, cols = input.cols;
+    const int top = std::min(r, rows), bottom = std::max(top, rows - r);
+    const int left = std::min(r, cols), right = std::max(left, cols - r);
+    tiles().run(rows, tile, [&](int first, int last) {
+        std::vector<const uint8_t*> window(kernel);
+        uint8_t unused;
+        for (auto i = first; i != last; ++i) {
+            auto *mag = magnitude.ptr<uint8_t>(i);
+            auto *ori = orientation ? orientation->ptr<uint8_t>(i) : nullptr;
+            auto edge = [&](int j) { edgeAt(input, i, j, *h, *v, *d, border, mag[j], ori ? ori[j] : unused); };
+            if (i < top || i >= bottom) {
+                for (auto j = 0; j != cols; ++j)
+                    edge(j);
+                continue;
+            }
+            for (auto j = 0; j != left; ++j)
+                edge(j);
+            for (auto j = right; j != cols; ++j)
+                edge(j);
+            for (auto k = 0; k != kernel; ++k)
+                window[k] = input.ptr<uint8_t>(i+k - r);
+            auto begin = avx2 ? vectorRow(window.data(), mag, ori, left, right) : left;
+            fixedRow(window.data(), mag, ori, begin, right);
         }
+    });
+}
+
+/* Check, bit for bit, the vector engine against the scalar loops and
+ * the banded filters against a single band over the whole image, for
+ * every predefined kernel and border mode on the given images. Bands of
+ * 7 rows make every halo cross band boundaries. Large kernels check the
+ * FFT path, with small tiles to cross tile boundaries too.
+ */
+static int verify(ImageCatalogue &images)
+{
+    Kernel *kernels[] = {
+        &MEAN_3, &MEAN_5, &MEAN_7, &GRADIENT_H_3, &GRADIENT_H_5, &GRADIENT_H_7,
+        &GRADIENT_V_3, &GRADIENT_V_5, &GRADIENT_V_7, &LAPLACIAN_3, &LAPLACIAN_5, &LAPLACIAN_7,
+        &SOBEL_H_3, &SOBEL_H_5, &SOBEL_H_7, &SOBEL_V_3, &SOBEL_V_5, &SOBEL_V_7,
+        &SOBEL_D_3, &SOBEL_D_5, &SOBEL_D_7,
+    };
+    if (!simd::usable(MEAN_3))
+        std::cout << "No vector engine on this CPU, checking the scalar paths only" << std::endl;
+    auto differ = [](const cv::Mat &a, const cv::Mat &b) {
+        auto rows = 0;
+        for (auto i = 0; i != a.rows; ++i)
+            rows += !std::equal(a.ptr<uint8_t>(i), a.ptr<uint8_t>(i) + a.cols, b.ptr<uint8_t>(i));
+        return rows;
+    };
+    std::vector<FilterKernel> large;                                                // Frequency domain sizes
+    std::vector<int> sizes;                                                         // Small tiles for them
+    auto seed = 1u;
+    for (auto n: { 9, 21 }) {
+        std::vector<std::vector<int>> taps(n, std::vector<int>(n)), separable(taps);
+        for (auto &row: taps)
+            for (auto &tap: row)
+                tap = int((seed = seed*1103515245 + 12345) >> 16) % 21 - 10;
+        for (auto k = 0; k != n; ++k)
+            for (auto l = 0; l != n; ++l)
+                separable[k][l] = (1 + std::min(k, n-1 - k)) * (1 + std::min(l, n-1 - l));
+        large.emplace_back(taps);
+        large.emplace_back(separable);
+        sizes.insert(sizes.end(), 2, n == 9 ? 20 : 48);
+    }
+    auto mismatches = 0;
+    for (size_t image = 0; image != images.size(); ++image) {
+        const auto input = images.at(image);
+        for (size_t k = 0; k != large.size(); ++k) {
+            const auto &h = large[k];
+            const FrequencyKernel g(h, sizes[k]);
+            for (auto mode: { BORDER::REPLICATE, BORDER::REFLECT, BORDER::CONSTANT }) {
+                cv::Mat scalar(input.size(), CV_8UC1), chosen(input.size(), CV_8UC1), banded(input.size(), CV_8UC1);
+                convoluteGeneric(input, scalar, h, Border(mode), 0, input.rows, false);
+                convolute(input, chosen, h, Border(mode));
+                tiles().run(input.rows, 7, [&](int first, int last) {
+                    convoluteFrequency(input, banded, h, g, Border(mode), first, last);
+                });
+                mismatches += differ(scalar, chosen) + differ(scalar, banded);
+            }
+        }
+        for (auto h: kernels) {
+            for (auto mode: { BORDER::REPLICATE, BORDER::REFLECT, BORDER::CONSTANT }) {
+                cv::Mat scalar(input.size(), CV_8UC1), vector(input.size(), CV_8UC1), banded(input.size(), CV_8UC1);
+                convoluteGeneric(input, scalar, *h, Border(mode), 0, input.rows, false);
+                convoluteGeneric(input, vector, *h, Border(mode), 0, input.rows, true);
+                convolute(input, banded, *h, Border(mode), 7);
+                mismatches += differ(scalar, vector) + differ(scalar, banded);
+            }
+        }
+        for (auto kernel: { 3, 5, 7 }) {
+            cv::Mat whole(input.size(), CV_8UC1), banded(input.size(), CV_8UC1);
+            MedianHistogram(input, whole, kernel, 0, input.rows);
+            Median(input, banded, kernel, 7);
+            mismatches += differ(whole, banded);
+
+            cv::Mat magnitude(input.size(), CV_8UC1), orientation(input.size(), CV_8UC1);
+            cv::Mat referenceMagnitude(input.size(), CV_8UC1), referenceOrientation(input.size(), CV_8UC1);
+            Edges(input, magnitude, &orientation, kernel, Border(), 7);
+            Kernel *h = kernel == 3 ? &SOBEL_H_3 : kernel == 5 ? &SOBEL_H_5 : &SOBEL_H_7;
+            Kernel *v = kernel == 3 ? &SOBEL_V_3 : kernel == 5 ? &SOBEL_V_5 : &SOBEL_V_7;
+            Kernel *d = kernel == 3 ? &SOBEL_D_3 : kernel == 5 ? &SOBEL_D_5 : &SOBEL_D_7;
+            for (auto i = 0; i != input.rows; ++i)
+                for (auto j = 0; j != input.cols; ++j)
+                    edgeAt(input, i, j, *h, *v, *d, Border(),
+                           referenceMagnitude.ptr<uint8_t>(i)[j], referenceOrientation.ptr<uint8_t>(i)[j]);
+            mismatches += differ(magnitude, referenceMagnitude) + differ(orientation, referenceOrientation);
+        }
+    }
+    std::cout << (mismatches ? "FAILED: " : "OK: ") << mismatches << " mismatching rows on " << tiles().size() << " threads" << std::endl;
+    return mismatches ? 1 : 0;
+}
+
+/* Name on the command line, label in the GUI, and kernels by size for
+ * every filter, in the order of FILTER. Median and the fused edge
+ * operator have no convolution kernel.
+ */
+struct FilterInfo {
+    const char *name, *label;
+    Kernel *kernels[3];
+};
+
+const FilterInfo filters[] = {
+    { "mean",            "Mean: ",                { &MEAN_3, &MEAN_5, &MEAN_7 } },
+    { "median",          "Median: ",              { nullptr, nullptr, nullptr } },
+    { "gradient-h",      "Gradient Horizontal: ", { &GRADIENT_H_3, &GRADIENT_H_5, &GRADIENT_H_7 } },
+    { "gradient-v",      "Gradient Vertical: ",   { &GRADIENT_V_3, &GRADIENT_V_5, &GRADIENT_V_7 } },
+    { "laplacian",       "Laplacian: ",           { &LAPLACIAN_3, &LAPLACIAN_5, &LAPLACIAN_7 } },
+    { "sobel-h",         "Sobel Horizontal: ",    { &SOBEL_H_3, &SOBEL_H_5, &SOBEL_H_7 } },
+    { "sobel-v",         "Sobel Vertical: ",      { &SOBEL_V_3, &SOBEL_V_5, &SOBEL_V_7 } },
+    { "sobel-d",         "Sobel Diagonal: ",      { &SOBEL_D_3, &SOBEL_D_5, &SOBEL_D_7 } },
+    { "sobel-magnitude", "Sobel Magnitude: ",     { nullptr, nullptr, nullptr } },
+};
+const char *borders[] = { "replicate", "reflect", "constant" };
+
+static cv::Mat applyFilter(const cv::Mat &input, FILTER filter, KERNEL kernel, const Border &border)
+{
+    cv::Mat output(input.size(), input.type());
+    const auto size = 2*kernel + 3;
+    switch (filter) {
+    case FILTER::MEDIAN:
+        Median(input, output, size);
+        break;
+    case FILTER::SOBEL_MAGNITUDE:
+        Edges(input, output, nullptr, size, border);
         break;
+    default:
+        convolute(input, output, *filters[filter].kernels[kernel], border);
     }
+    return output;
+}
+
+/* Filter results of the last few settings, least recently used dropped
+ * first, so moving a slider back to an earlier setting costs nothing.
+ * The border mode is part of the key since it changes the output.
+ */
+class ResultCache {
+public:
+    typedef std::tuple<size_t, int, int, int> Key;                                  // Image, filter, kernel, border
+
+    explicit ResultCache(size_t capacity): capacity(capacity) {}
+
+    template<typename Compute>
+    cv::Mat get(const Key &key, Compute compute)
+    {
+        auto hit = index.find(key);
+        if (hit != index.end()) {
+            entries.splice(entries.begin(), entries, hit->second);                  // Now most recently used
+            return hit->second->second;
+        }
+        cv::Mat result = compute();
+        if (capacity == 0)
+            return result;
+        entries.emplace_front(key, result);
+        index[key] = entries.begin();
+        if (entries.size() > capacity) {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+        return result;
+    }
+
+    void resize(size_t entries) { capacity = entries; }
+
+private:
+    size_t capacity;
+    std::list<std::pair<Key, cv::Mat>> entries;
+    std::map<Key, std::list<std::pair<Key, cv::Mat>>::iterator> index;
+};
+
+ResultCache results(32);
+
+static void callBack(int, void*)
+{
+    cv::Mat display, input = unfiltered().at(imagePos);
+    auto filter = static_cast<FILTER>(filterPos);
+    auto kernel = static_cast<KERNEL>(kernelPos);
+    Border border(static_cast<BORDER>(borderPos));
+    cv::Mat output = results.get(ResultCache::Key(imagePos, filterPos, kernelPos, borderPos), [&] {
+        return applyFilter(input, filter, kernel, border);
+    });
     cv::hconcat(input, output, display);
-    std::string text(filterText + "Kernel=" + kernel);
+    std::string text(filters[filter].label + std::string("Kernel=") + std::to_string(2*kernel + 3));
     cv::putText(display, text, cv::Point(768, 20), cv::FONT_HERSHEY_PLAIN, 1, 0);
     cv::putText(display, text, cv::Point(768, 50), cv::FONT_HERSHEY_PLAIN, 1, 255);
     cv::imshow("Spatial Filtering", display);
 }
 
-int main()
+/* Run the chosen filters, kernel sizes and border mode over every image
+ * below a directory without opening a window, writing one PNG per
+ * result named <image>-<filter>-<kernel>.png into the output directory.
+ */
+static int batch(const std::string &root, const std::string &outputDir, const std::vector<FILTER> &filterSet,
+                 const std::vector<KERNEL> &kernelSet, const Border &border)
 {
-    for (auto& file: fs::recursive_directory_iterator(".")) {
-        std::string imagePath(static_cast<std::string>(file.path()));
-        if (imagePath.find(".jpg") != std::string::npos) {
-            unfiltered.push_back(cv::imread(imagePath, cv::IMREAD_GRAYSCALE));
+    fs::create_directories(outputDir);
+    auto written = 0;
+    for (auto &path: findImages(root)) {
+        cv::Mat input = cv::imread(path, cv::IMREAD_GRAYSCALE);
+        if (input.empty()) {
+            std::cerr << "Cannot read " << path << std::endl;
+            return 1;
+        }
+        for (auto filter: filterSet) {
+            for (auto kernel: kernelSet) {
+                auto name = fs::path(path).stem().string() + "-" + filters[filter].name + "-"
+                          + std::to_string(2*kernel + 3) + ".png";
+                if (!cv::imwrite((fs::path(outputDir) / name).string(), applyFilter(input, filter, kernel, border))) {
+                    std::cerr << "Cannot write " << name << std::endl;
+                    return 1;
+                }
+                ++written;
+            }
         }
     }
+    std::cout << written << " images written to " << outputDir << std::endl;
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    auto check = false;
+    std::string batchDir, outputDir("filtered");
+    std::vector<FILTER> filterSet;
+    std::vector<KERNEL> kernelSet;
+    auto borderMode = BORDER::REPLICATE;
+    auto usage = [&] {
+        std::cerr << "Usage: " << argv[0] << " [--threads N] [--tile ROWS] [--cache ENTRIES] [--memory MB] [--verify]\n"
+                  << "       " << argv[0] << " --batch DIR [--output DIR] [--filter NAME]... [--kernel 3|5|7]...\n"
+                  << "                 [--border replicate|reflect|constant]\n"
+                  << "Filters:";
+        for (auto &f: filters)
+            std::cerr << " " << f.name;
+        std::cerr << std::endl;
+        return 1;
+    };
+    for (auto a = 1; a < argc; ++a) {
+        std::string option(argv[a]);
+        if (option == "--verify")
+            check = true;
+        else if (a + 1 == argc)
+            return usage();
+        else if (option == "--threads")
+            threadCount = std::max(std::stoi(argv[++a]), 1);
+        else if (option == "--tile")
+            tileRows = std::stoi(argv[++a]);
+        else if (option == "--cache")
+            results.resize(std::stoul(argv[++a]));
+        else if (option == "--memory")
+            memoryBudget = std::stoul(argv[++a]) << 20;
+        else if (option == "--batch")
+            batchDir = argv[++a];
+        else if (option == "--output")
+            outputDir = argv[++a];
+        else if (option == "--filter") {
+            std::string name(argv[++a]);
+            auto f = std::find_if(std::begin(filters), std::end(filters), [&](const FilterInfo &f) { return name == f.name; });
+            if (f == std::end(filters))
+                return usage();
+            filterSet.push_back(static_cast<FILTER>(f - std::begin(filters)));
+        }
+        else if (option == "--kernel") {
+            std::string size(argv[++a]);
+            if (size != "3" && size != "5" && size != "7")
+                return usage();
+            kernelSet.push_back(static_cast<KERNEL>((std::stoi(size) - 3)/2));
+        }
+        else if (option == "--border") {
+            std::string name(argv[++a]);
+            auto b = std::find(std::begin(borders), std::end(borders), name);
+            if (b == std::end(borders))
+                return usage();
+            borderMode = static_cast<BORDER>(b - std::begin(borders));
+        }
+        else
+            return usage();
+    }
+    if (!batchDir.empty()) {
+        if (filterSet.empty())                                                      // Default to everything
+            for (auto f = 0; f != int(std::end(filters) - std::begin(filters)); ++f)
+                filterSet.push_back(static_cast<FILTER>(f));
+        if (kernelSet.empty())
+            kernelSet = { KERNEL::THREE, KERNEL::FIVE, KERNEL::SEVEN };
+        return batch(batchDir, outputDir, filterSet, kernelSet, Border(borderMode));
+    }
+
+    auto &images = unfiltered();
+    images.open(".");
+    if (images.size() == 0) {
+        std::cerr << "No .jpg images below the current directory" << std::endl;
+        return 1;
+    }
+    if (check)
+        return verify(images);
 
     cv::namedWindow("Spatial Filtering");
     cv::createTrackbar(
         "Image",
         "Spatial Filtering",
         &imagePos,
-        unfiltered.size() - 1,
+        images.size() - 1,
         callBack
     );
     cv::createTrackbar(
         "Filter",
         "Spatial Filtering",
         &filterPos,
-        7,
+        int(std::end(filters) - std::begin(filters)) - 1,
         callBack
     );
     cv::createTrackbar(
@@ -348,6 +1772,13 @@ int main()
         2,
         callBack
     );
+    cv::createTrackbar(
+        "Border",
+        "Spatial Filtering",
+        &borderPos,
+        2,
+        callBack
+    );
     callBack(0, NULL);
     cv::waitKey(0);
     return 0;
@@ -1,118 +1,73 @@
 #include <opencv2/opencv.hpp>
 
+#include <chrono>
 #include <complex>
 #include <experimental/filesystem>
 #include <iostream>
-#include <numeric>
-#include <valarray>
+#include <list>
+#include <map>
+#include <memory>
+#include <tuple>
 #include <vector>
 
+#include "fft.hpp"
+
 using namespace std;
 using namespace std::complex_literals;
 using Complex = std::complex<double>;
+using FFT::Aligned;
+using FFT::BasicSpectrum;
+using FFT::Spectrum;
+using FFT::SpectrumF;
 
-const auto N = 512;
-const auto PI = std::acos(-1);
 auto images = std::vector<cv::Mat>();
 int imagePos, filterPos, freqPos;
+auto singlePrecision = false;                                                       // Transform in float
 
 
-namespace FFT {
-    valarray<Complex> transform(const valarray<Complex> x)
-    {
-        auto n = x.size();
-        auto X = valarray<Complex>(n);
-        if (n == 1) return x;
-        auto even = FFT::transform(x[slice(0, n/2, 2)]);
-        auto odd  = FFT::transform(x[slice(1, n/2, 2)]);
-        for (auto k = 0; k != n/2; k++) {
-            auto twiddle = exp(-2 * PI * k / n * 1i);
-            X[k] = even[k] + twiddle * odd[k];
-            X[k + n/2] = even[k] - twiddle * odd[k];
-        }
-        return X;
-    }
-
-    valarray<Complex> inverseTransform(valarray<Complex> X)
-    {
-        X = X.apply([](Complex z) { return 1i * conj(z); });
-        auto x = FFT::transform(X);
-        x = x.apply([](Complex z) { return 1i * conj(z); });
-        return x / static_cast<Complex>(x.size());
-    }
+namespace Filter {
+    /* Gain of a filter at every kept bin of a height x width spectrum,
+     * laid out like Spectrum. The filters here are real and depend only
+     * on the distance from zero frequency, so rows i and height - i are
+     * equal and each is computed once.
+     */
+    struct Transfer {
+        int height, width, stride;
+        vector<double, Aligned<double>> gain;
 
-    valarray<valarray<Complex>>& transpose(valarray<valarray<Complex>> &X)
-    {
-        for (auto i = 0; i != N; ++i) {
-            for (auto j = 0; j != i; ++j) {
-                swap(X[i][j], X[j][i]);
+        template<typename Gain>
+        Transfer(int height, int width, Gain at)
+        : height(height), width(width), stride((width/2 + 4) & ~3), gain(size_t(height) * stride)
+        {
+            for (auto i = 0; i <= height/2; ++i) {                                  // |u|, |v| are i, j
+                auto *row = (*this)[i], *mirrored = (*this)[(height - i)%height];
+                for (auto j = 0; j != width/2 + 1; ++j) {
+                    row[j] = mirrored[j] = at(i, j);
+                }
             }
         }
-        return X;
-    }
 
-    valarray<valarray<Complex>> transform2d(const cv::Mat x)
-    {
-        auto X = valarray<valarray<Complex>>(valarray<Complex>(N), N);
-        for (auto i = 0; i != N; ++i) {
-            for (auto j = 0; j != N; ++j) {
-                X[i][j] = static_cast<Complex>(x.at<uint8_t>(i, j));
-            }
-            X[i] = FFT::transform(X[i]);
-        }
-        X = FFT::transpose(X);
-        for (auto i = 0; i != N; ++i) {
-            X[i] = FFT::transform(X[i]);
-        }
-        return FFT::transpose(X);
-    }
+        double* operator[](int i) { return &gain[size_t(i) * stride]; }
+        const double* operator[](int i) const { return &gain[size_t(i) * stride]; }
+    };
 
-    valarray<valarray<Complex>> shift2d(const valarray<valarray<Complex>> &X)
+    /* The filtered spectrum, X times the gain bin by bin. */
+    template<typename T>
+    BasicSpectrum<T> apply(const BasicSpectrum<T> &X, const Transfer &H)
     {
-        auto ret = valarray<valarray<Complex>>(valarray<Complex>(N), N);
-        for (auto i = 0; i != N; ++i) {
-            for (auto j = 0; j != N; ++j) {
-                ret[(N/2 + i)%N][(N/2 + j)%N] = log(1 + abs(X[i][j]));
+        auto ret = BasicSpectrum<T>(X.height, X.width);
+        const auto bins = X.bins();
+        for (auto i = 0; i != X.height; ++i) {
+            const auto *x = X[i];
+            const auto *h = H[i];
+            auto *y = ret[i];
+            for (auto j = 0; j != bins; ++j) {
+                y[j] = x[j] * T(h[j]);
             }
         }
         return ret;
     }
 
-    cv::Mat inverseTransform2d(valarray<valarray<Complex>> X)
-    {
-        auto x = cv::Mat(N, N, CV_8UC1);
-        for (auto i = 0; i != N; ++i) {
-            for (auto j = 0; j != N; ++j) {
-                X[i][j] = 1i * conj(X[i][j]);
-            }
-            X[i] = FFT::inverseTransform(X[i]);
-        }
-        X = FFT::transpose(X);
-        for (auto i = 0; i != N; ++i) {
-            X[i] = FFT::inverseTransform(X[i]);
-        }
-        X = FFT::transpose(X);
-        for (auto i = 0; i != N; ++i) {
-            for (auto j = 0; j != N; ++j) {
-                x.at<uint8_t>(N-1-i, N-1-j) = static_cast<uint8_t>(abs(1i * conj(X[i][j])));
-            }
-        }
-        return x;
-    }
-
-    cv::Mat toMat(const valarray<valarray<Complex>> &X)
-    {
-        auto x = cv::Mat(N, N, CV_8UC1);
-        for (auto i = 0; i != N; ++i) {
-            for (auto j = 0; j != N; ++j) {
-                x.at<uint8_t>(i, j) = 255/18 * static_cast<uint8_t>(X[i][j].real());
-            }
-        }
-        return x;
-    }
-}
-
-namespace Filter {
     namespace LowPass {
         enum _ {
             Ideal=0,
@@ -120,44 +75,25 @@ namespace Filter {
             Butterworth,
         };
 
-        valarray<valarray<Complex>> ideal(const valarray<valarray<Complex>> X, int cutoff)
+        Transfer ideal(int height, int width, int cutoff)
         {
-            auto ret = valarray<valarray<Complex>>(valarray<Complex>(N), N);
-            for (auto i = 0; i != N; ++i) {
-                for (auto j = 0; j != N; ++j) {
-                    if (abs(Complex((N/2 + i)%N - N/2, (N/2 + j)%N - N/2)) > cutoff) {
-                        ret[i][j] = 0;
-                    }
-                    else {
-                        ret[i][j] = X[i][j];
-                    }
-                }
-            }
-            return ret;
+            return Transfer(height, width, [=](int u, int v) {
+                return u*u + v*v > cutoff*cutoff ? 0.0 : 1.0;                       // |(u, v)| > cutoff
+            });
         }
 
-        valarray<valarray<Complex>> gaussian(const valarray<valarray<Complex>> X, int stdDev)
+        Transfer gaussian(int height, int width, int stdDev)
         {
-            auto ret = valarray<valarray<Complex>>(valarray<Complex>(N), N);
-            for (auto i = 0; i != N; ++i) {
-                for (auto j = 0; j != N; ++j) {
-                    ret[i][j] = X[i][j] *
-                        exp(-(pow((N/2 + i)%N - N/2, 2) + pow((N/2 + j)%N - N/2, 2))/(2*pow(stdDev, 2)));
-                }
-            }
-            return ret;
+            return Transfer(height, width, [=](int u, int v) {
+                return exp(-(pow(u, 2) + pow(v, 2))/(2*pow(stdDev, 2)));
+            });
         }
 
-        valarray<valarray<Complex>> butterworth(const valarray<valarray<Complex>> X, int cutoff, int order=1)
+        Transfer butterworth(int height, int width, int cutoff, int order=1)
         {
-            auto ret = valarray<valarray<Complex>>(valarray<Complex>(N), N);
-            for (auto i = 0; i != N; ++i) {
-                for (auto j = 0; j != N; ++j) {
-                    ret[i][j] = X[i][j] /
-                        (1 + pow(abs(Complex((N/2 + i)%N - N/2, (N/2 + j)%N - N/2))/cutoff, 2*order));
-                }
-            }
-            return ret;
+            return Transfer(height, width, [=](int u, int v) {
+                return 1 / (1 + pow(abs(Complex(u, v))/cutoff, 2*order));
+            });
         }
     };
     namespace HighPass {
@@ -167,101 +103,306 @@ namespace Filter {
             Butterworth,
         };
 
-        valarray<valarray<Complex>> ideal(const valarray<valarray<Complex>> X, int cutoff)
+        Transfer ideal(int height, int width, int cutoff)
         {
-            auto ret = valarray<valarray<Complex>>(valarray<Complex>(N), N);
-            for (auto i = 0; i != N; ++i) {
-                for (auto j = 0; j != N; ++j) {
-                    if (abs(Complex((N/2 + i)%N - N/2, (N/2 + j)%N - N/2)) > cutoff) {
-                        ret[i][j] = X[i][j];
-                    }
-                    else {
-                        ret[i][j] = 0;
-                    }
-                }
-            }
-            return ret;
+            return Transfer(height, width, [=](int u, int v) {
+                return u*u + v*v > cutoff*cutoff ? 1.0 : 0.0;
+            });
         }
 
-        valarray<valarray<Complex>> gaussian(const valarray<valarray<Complex>> X, int stdDev)
+        Transfer gaussian(int height, int width, int stdDev)
         {
-            auto ret = valarray<valarray<Complex>>(valarray<Complex>(N), N);
-            for (auto i = 0; i != N; ++i) {
-                for (auto j = 0; j != N; ++j) {
-                    ret[i][j] = X[i][j] *
-                        (1 - exp(-(pow((N/2 + i)%N - N/2, 2) + pow((N/2 + j)%N - N/2, 2))/(2*pow(stdDev, 2))));
-                }
-            }
-            return ret;
+            return Transfer(height, width, [=](int u, int v) {
+                return 1 - exp(-(pow(u, 2) + pow(v, 2))/(2*pow(stdDev, 2)));
+            });
         }
 
-        valarray<valarray<Complex>> butterworth(const valarray<valarray<Complex>> X, int cutoff, int order=1)
+        Transfer butterworth(int height, int width, int cutoff, int order=1)
         {
-            auto ret = valarray<valarray<Complex>>(valarray<Complex>(N), N);
-            for (auto i = 0; i != N; ++i) {
-                for (auto j = 0; j != N; ++j) {
-                    ret[i][j] = X[i][j] /
-                        (1 + pow(cutoff / abs(Complex((N/2 + i)%N - N/2, (N/2 + j)%N - N/2)), 2*order));
-                }
-            }
-            return ret;
+            return Transfer(height, width, [=](int u, int v) {
+                return 1 / (1 + pow(cutoff / abs(Complex(u, v)), 2*order));
+            });
         }
     };
+
+    Transfer transfer(int filter, int height, int width, int cutoff, int order)
+    {
+        switch (filter) {
+        case LowPass::Ideal:        return LowPass::ideal(height, width, cutoff);
+        case LowPass::Gaussian:     return LowPass::gaussian(height, width, cutoff);
+        case LowPass::Butterworth:  return LowPass::butterworth(height, width, cutoff, order);
+        case HighPass::Ideal:       return HighPass::ideal(height, width, cutoff);
+        case HighPass::Gaussian:    return HighPass::gaussian(height, width, cutoff);
+        default:                    return HighPass::butterworth(height, width, cutoff, order);
+        }
+    }
 };
 
-static void callBack(int, void*)
+/* Least recently used values, kept for when the sliders come back to
+ * them. Values are shared, so an evicted one stays valid while in use.
+ */
+template<typename Key, typename Value>
+class Cache {
+public:
+    explicit Cache(size_t capacity): capacity(capacity) {}
+
+    template<typename Compute>
+    shared_ptr<const Value> get(const Key &key, Compute compute)
+    {
+        auto hit = index.find(key);
+        if (hit != index.end()) {
+            entries.splice(entries.begin(), entries, hit->second);                  // Now most recently used
+            return hit->second->second;
+        }
+        auto value = make_shared<const Value>(compute());
+        entries.emplace_front(key, value);
+        index[key] = entries.begin();
+        if (entries.size() > capacity) {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+        return value;
+    }
+
+private:
+    size_t capacity;
+    list<pair<Key, shared_ptr<const Value>>> entries;
+    map<Key, typename list<pair<Key, shared_ptr<const Value>>>::iterator> index;
+};
+
+auto spectra = Cache<int, Spectrum>(8);                                             // By image
+auto spectraF = Cache<int, SpectrumF>(8);                                           // By image, in float
+auto spectrumViews = Cache<int, cv::Mat>(8);                                        // Image above its spectrum
+auto transfers = Cache<tuple<int, int, int, int, int>, Filter::Transfer>(16);       // Filter, cutoff, order, size
+
+/* Only the first look at an image transforms it, and only the first use
+ * of a filter setting at a size computes its gains: moving a slider
+ * otherwise costs one multiply and one inverse transform.
+ */
+template<typename T>
+static void show(Cache<int, BasicSpectrum<T>> &spectra)
 {
     auto display = cv::Mat();
-    auto input = images.at(imagePos);
-    auto inputFFT = FFT::transform2d(input);
+    const auto &input = images.at(imagePos);
+    const auto cutoff = 20*(freqPos + 1), order = 1;
+
+    auto inputFFT = spectra.get(imagePos, [&] { return FFT::transform2d<T>(input); });
+    auto inputView = spectrumViews.get(imagePos, [&] {
+        auto view = cv::Mat();
+        cv::vconcat(input, FFT::toMat(*inputFFT), view);
+        return view;
+    });
+    auto transfer = transfers.get(make_tuple(filterPos, cutoff, order, input.rows, input.cols), [&] {
+        return Filter::transfer(filterPos, input.rows, input.cols, cutoff, order);
+    });
 
     auto output  = cv::Mat();
-    auto outputFFT = valarray<valarray<Complex>>();
-
-    switch(filterPos) {
-    case Filter::LowPass::Ideal:
-        outputFFT = Filter::LowPass::ideal(inputFFT, 20*(freqPos + 1));
-        break;
-    case Filter::HighPass::Ideal:
-        outputFFT = Filter::HighPass::ideal(inputFFT, 20*(freqPos + 1));
-        break;
-    case Filter::LowPass::Gaussian:
-        outputFFT = Filter::LowPass::gaussian(inputFFT, 20*(freqPos + 1));
-        break;
-    case Filter::HighPass::Gaussian:
-        outputFFT = Filter::HighPass::gaussian(inputFFT, 20*(freqPos + 1));
-        break;
-    case Filter::LowPass::Butterworth:
-        outputFFT = Filter::LowPass::butterworth(inputFFT, 20*(freqPos + 1));
-        break;
-    case Filter::HighPass::Butterworth:
-        outputFFT = Filter::HighPass::butterworth(inputFFT, 20*(freqPos + 1));
-        break;
-    }
-    cv::vconcat(
-        input,
-        FFT::toMat(FFT::shift2d(inputFFT)),
-        input
-    );
+    auto outputFFT = Filter::apply(*inputFFT, *transfer);
+    auto outputSpectrum = FFT::toMat(outputFFT);
     cv::vconcat(
-        FFT::inverseTransform2d(outputFFT),
-        FFT::toMat(FFT::shift2d(outputFFT)),
+        FFT::inverseTransform2d(move(outputFFT)),
+        outputSpectrum,
         output
     );
-    cv::hconcat(input, output, display);
+    cv::hconcat(*inputView, output, display);
     cv::imshow("Frequency Filtering", display);
 }
 
-int main()
+static void callBack(int, void*)
+{
+    if (singlePrecision)
+        show(spectraF);
+    else
+        show(spectra);
+}
+
+/* Names on the command line, in the order of the filter slider. */
+const char *filterNames[] = {
+    "ideal-lowpass", "gaussian-lowpass", "butterworth-lowpass",
+    "ideal-highpass", "gaussian-highpass", "butterworth-highpass",
+};
+
+/* Filter every .jpg below a directory, e.g. the frames of a video, with
+ * each chosen filter and cutoff without opening a window. Images are
+ * transformed a stack at a time, all the rows and columns of the stack
+ * spread over the threads, and written into the output directory as
+ * <image>-<filter>-<cutoff>.png.
+ */
+template<typename T>
+static int batch(const string &root, const string &outputDir, const vector<int> &filterSet,
+                 const vector<int> &cutoffSet, size_t stackSize)
+{
+    namespace fs = std::experimental::filesystem;
+    auto paths = vector<string>();
+    for (auto& file: fs::recursive_directory_iterator(root)) {
+        auto imagePath = string(static_cast<string>(file.path()));
+        if (imagePath.find(".jpg") != string::npos) {
+            paths.push_back(imagePath);
+        }
+    }
+    sort(paths.begin(), paths.end());
+    fs::create_directories(outputDir);
+
+    auto written = 0;
+    for (size_t first = 0; first < paths.size(); first += stackSize) {
+        auto stack = vector<cv::Mat>();
+        for (auto k = first; k != min(first + stackSize, paths.size()); ++k) {
+            stack.push_back(cv::imread(paths[k], cv::IMREAD_GRAYSCALE));
+            if (stack.back().empty()) {
+                cerr << "Cannot read " << paths[k] << endl;
+                return 1;
+            }
+        }
+        auto spectra = FFT::transform2d<T>(stack);
+        for (auto filter: filterSet) {
+            for (auto cutoff: cutoffSet) {
+                auto gains = vector<shared_ptr<const Filter::Transfer>>();               // The cache is not shared
+                for (auto &image: stack) {
+                    gains.push_back(transfers.get(make_tuple(filter, cutoff, 1, image.rows, image.cols), [&] {
+                        return Filter::transfer(filter, image.rows, image.cols, cutoff, 1);
+                    }));
+                }
+                auto filtered = vector<BasicSpectrum<T>>(stack.size());
+                FFT::parallel(stack.size(), [&](size_t k) {
+                    filtered[k] = Filter::apply(spectra[k], *gains[k]);
+                });
+                auto outputs = FFT::inverseTransform2d(move(filtered));
+                for (size_t k = 0; k != stack.size(); ++k) {
+                    auto name = fs::path(paths[first + k]).stem().string() + "-" + filterNames[filter] + "-"
+                              + to_string(cutoff) + ".png";
+                    if (!cv::imwrite((fs::path(outputDir) / name).string(), outputs[k])) {
+                        cerr << "Cannot write " << name << endl;
+                        return 1;
+                    }
+                    ++written;
+                }
+            }
+        }
+    }
+    cout << written << " images written to " << outputDir << endl;
+    return 0;
+}
+
+/* Compare single with double precision on the images loaded: the
+ * relative error of each spectrum against the bound in fft.hpp, how many
+ * pixels of each filtered image differ at cutoff 60, and the time of both
+ * transforms. Fails if a spectrum is over the bound.
+ */
+static int compare()
+{
+    using Clock = chrono::steady_clock;
+    auto milliseconds = [](Clock::duration d) { return chrono::duration<double, milli>(d).count(); };
+    auto passed = true;
+    for (const auto &image: images) {
+        auto start = Clock::now();
+        auto X = FFT::transform2d<double>(image);
+        const auto doubleTime = Clock::now() - start;
+        start = Clock::now();
+        auto Y = FFT::transform2d<float>(image);
+        const auto singleTime = Clock::now() - start;
+
+        auto error = 0.0, energy = 0.0;
+        for (auto i = 0; i != X.height; ++i) {
+            for (auto j = 0; j != X.bins(); ++j) {
+                error += norm(X[i][j] - Complex(Y[i][j]));
+                energy += norm(X[i][j]);
+            }
+        }
+        const auto relative = sqrt(error / max(energy, 1e-300));
+        const auto bound = FFT::singlePrecisionBound(image.rows, image.cols);
+        passed = passed && relative <= bound;
+        cout << image.cols << "x" << image.rows << ": relative error " << relative << " (bound " << bound
+             << "), double " << milliseconds(doubleTime) << " ms, single " << milliseconds(singleTime) << " ms" << endl;
+
+        for (auto filter = 0; filter != int(end(filterNames) - begin(filterNames)); ++filter) {
+            const auto H = Filter::transfer(filter, image.rows, image.cols, 60, 1);
+            const auto a = FFT::inverseTransform2d(Filter::apply(X, H));
+            const auto b = FFT::inverseTransform2d(Filter::apply(Y, H));
+            auto differ = 0, largest = 0;
+            for (auto i = 0; i != a.rows; ++i) {
+                for (auto j = 0; j != a.cols; ++j) {
+                    const auto d = abs(int(a.at<uint8_t>(i, j)) - int(b.at<uint8_t>(i, j)));
+                    differ += d != 0;
+                    largest = max(largest, d);
+                }
+            }
+            cout << "  " << filterNames[filter] << ": " << differ << " pixels differ, by at most " << largest << endl;
+        }
+    }
+    cout << (passed ? "Within the bound" : "Over the bound") << endl;
+    return passed ? 0 : 1;
+}
+
+int main(int argc, char* argv[])
 {
+    auto batchDir = string(), outputDir = string("filtered");
+    auto filterSet = vector<int>(), cutoffSet = vector<int>();
+    auto stackSize = size_t(8);
+    auto comparing = false;
+    auto usage = [&] {
+        cerr << "Usage: " << argv[0] << " [--precision single|double] [--threads N]\n"
+             << "       " << argv[0] << " --batch DIR [--output DIR] [--filter NAME]... [--cutoff F]...\n"
+             << "                 [--stack IMAGES] [--precision single|double] [--threads N]\n"
+             << "       " << argv[0] << " --compare [--threads N]\n"
+             << "Filters:";
+        for (auto name: filterNames)
+            cerr << " " << name;
+        cerr << endl;
+        return 1;
+    };
+    for (auto a = 1; a < argc; ++a) {
+        auto option = string(argv[a]);
+        if (option == "--compare")
+            comparing = true;
+        else if (a + 1 == argc)
+            return usage();
+        else if (option == "--threads")
+            FFT::threads() = max(stoi(argv[++a]), 1);
+        else if (option == "--batch")
+            batchDir = argv[++a];
+        else if (option == "--output")
+            outputDir = argv[++a];
+        else if (option == "--stack")
+            stackSize = max(stoi(argv[++a]), 1);
+        else if (option == "--cutoff")
+            cutoffSet.push_back(max(stoi(argv[++a]), 1));
+        else if (option == "--precision") {
+            auto precision = string(argv[++a]);
+            if (precision != "single" && precision != "double")
+                return usage();
+            singlePrecision = precision == "single";
+        }
+        else if (option == "--filter") {
+            auto name = string(argv[++a]);
+            auto f = find(begin(filterNames), end(filterNames), name);
+            if (f == end(filterNames))
+                return usage();
+            filterSet.push_back(f - begin(filterNames));
+        }
+        else
+            return usage();
+    }
+    if (!batchDir.empty()) {
+        if (filterSet.empty())                                                      // Default to every filter
+            for (auto f = 0; f != int(end(filterNames) - begin(filterNames)); ++f)
+                filterSet.push_back(f);
+        if (cutoffSet.empty())
+            cutoffSet.push_back(60);
+        if (singlePrecision)
+            return batch<float>(batchDir, outputDir, filterSet, cutoffSet, stackSize);
+        return batch<double>(batchDir, outputDir, filterSet, cutoffSet, stackSize);
+    }
+
     for (auto& file: std::experimental::filesystem::directory_iterator(".")) {
         auto imagePath = std::string(static_cast<std::string>(file.path()));
         if (imagePath.find(".jpg") != std::string::npos) {
             auto img = cv::imread(imagePath, cv::IMREAD_GRAYSCALE);
-            if (img.rows == N && img.cols == N)
+            if (!img.empty())
                 images.push_back(img);
         }
     }
+    if (comparing)
+        return compare();
 
     cv::namedWindow("Frequency Filtering");
     cv::createTrackbar(